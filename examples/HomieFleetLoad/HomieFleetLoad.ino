@@ -0,0 +1,372 @@
+/*
+    Load generator: simulates a fleet of homie devices built from one template schema, for capacity testing a
+    broker and its controllers with initial publishing bursts, reconnect storms and telemetry.
+    Runs a few dozen devices on an ESP32. Point MQTT_HOST at the broker under test, a local mosquitto works well.
+    Thousands run on a PC against the simulated broker in extras/host:
+        make -C extras/host fleet FLEET_SIZE=2000 && extras/host/fleet_load 100
+    builds this sketch with the allocation profiler and runs it for 100 seconds, see extras/host/Makefile. The run
+    fails if any device isn't ready at the end, the time to ready percentiles only cover the ones that got there.
+    The scenarios below take the broker down for a while and make it slow to acknowledge; the host broker does
+    both itself, on a real one the broker-down phase points every connection at a closed port.
+*/
+
+#if defined(ARDUINO_ARCH_ESP8266)
+#include <ESP8266WiFi.h>
+#else
+#include "WiFi.h"
+#endif
+#include <LeifHomieLib.h>
+
+#ifndef STASSID
+#define STASSID "your-ssid"
+#define STAPSK  "your-password"
+#endif
+
+#ifndef MQTT_HOST
+#define MQTT_HOST "192.168.1.2"
+#define MQTT_USER "your-mqttuser"
+#define MQTT_PASS "your-mqttpassword"
+#endif
+
+#ifndef FLEET_SIZE
+#define FLEET_SIZE 32
+#endif
+
+const int fleetSize=FLEET_SIZE;
+const bool bSharedConnection=true;				//virtual devices behind one gateway connection, false for one connection per device
+const unsigned long updateInterval_ms=1000;		//each device sets its values this often, any fleet size
+const unsigned long burstInterval_ms=0;			//every device sets every value at once this often, 0 for never
+const unsigned long reconnectInterval_ms=120000;	//drop every connection this often to cause a reconnect storm, 0 for never
+const unsigned long reportInterval_ms=10000;
+const int initialPublishingThrottle_ms=20;		//the library default is 200, lower makes the initial publishing burst harder
+const int gatewayStepsPerTick=fleetSize/2>8?fleetSize/2:8;	//initial publishing steps the virtual devices share per 100 ms, the library
+																//default 8 leaves a big fleet not ready for minutes after every reconnect
+
+//scenarios, each once, times after setup, a duration of 0 skips it
+const unsigned long brokerDownAt_ms=30000;		//every connection loses the broker and backs off until it's back
+const unsigned long brokerDownFor_ms=20000;
+const uint16_t mqttDeadPort=1;					//nothing listens there
+const unsigned long slowAckAt_ms=70000;			//PUBACKs take slowAck_ms, the health monitors should degrade and stall
+const unsigned long slowAckFor_ms=20000;
+const unsigned long slowAck_ms=6000;			//over the 5 s stall minimum
+
+std::vector<HomieDevice *> fleet;
+std::vector<uint8_t> schema;
+
+unsigned long ulStartTimestamp=0;
+unsigned long ulUpdateTimestamp=0;
+unsigned long ulUpdateCredit=0;	//device updates owed times updateInterval_ms
+unsigned long ulBurstTimestamp=0;
+unsigned long ulReconnectTimestamp=0;
+unsigned long ulReportTimestamp=0;
+uint32_t ulLastPublishes=0;
+size_t iNextDevice=0;
+int scenarioStep=0;
+long heapAtBoot=0;
+
+//Heap the fleet holds, -1 if unknown. A profiling build (the host one is) sums what the library's allocation sites
+//retain, see HomieAlloc.h, otherwise the ESP's free heap is all there is to go by.
+long HeapInUse()
+{
+#if defined(HOMIELIB_ALLOC_PROFILE)
+	long retained=0;
+	for(int i=0;i<homieAllocSiteCount;i++) retained+=HomieAllocGetStats((eHomieAllocSite)i).retained;
+	return retained;
+#elif defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
+	return heapAtBoot-(long)ESP.getFreeHeap();
+#else
+	return -1;
+#endif
+}
+
+//The template device, exported once so every simulated device is loaded from the same blob
+void BuildSchema()
+{
+	HomieDevice templateDevice;
+
+	HomieNode * pNode=templateDevice.NewNode();
+	pNode->id="sensors";
+	pNode->friendlyName="Sensors";
+
+	HomieProperty * pProp=pNode->NewProperty();
+	pProp->id="temperature";
+	pProp->friendlyName="Temperature";
+	pProp->unit="°C";
+	pProp->datatype=homieFloat;
+	pProp->precision=1;
+
+	pProp=pNode->NewProperty();
+	pProp->id="humidity";
+	pProp->friendlyName="Humidity";
+	pProp->unit="%";
+	pProp->datatype=homieInt;
+	pProp->strFormat="0:100";
+
+	pNode=templateDevice.NewNode();
+	pNode->id="controls";
+	pNode->friendlyName="Controls";
+
+	pProp=pNode->NewProperty();
+	pProp->id="switch";
+	pProp->friendlyName="Switch";
+	pProp->datatype=homieBool;
+	pProp->settable=true;
+
+	pProp=pNode->NewProperty();
+	pProp->id="light";
+	pProp->friendlyName="Light";
+	pProp->datatype=homieColor;
+	pProp->strFormat="rgb";
+	pProp->settable=true;
+
+	pProp=pNode->NewProperty();
+	pProp->id="alarm";
+	pProp->friendlyName="Alarm";
+	pProp->datatype=homieEnum;
+	pProp->strFormat="IDLE,TRIGGERED";
+	pProp->retained=false;
+	pProp->lane=homieLaneUrgent;
+
+	schema.resize(HomieSchemaExport(templateDevice,NULL,0));
+	HomieSchemaExport(templateDevice,schema.data(),schema.size());
+}
+
+void UpdateDevice(HomieDevice * pDevice)
+{
+	HomieNode * pSensors=pDevice->GetNode(0);
+	HomieNode * pControls=pDevice->GetNode(1);
+
+	pSensors->GetProperty(0)->SetFloat(20.0+(random(100)/10.0));
+	pSensors->GetProperty(1)->SetInt(40+random(20));
+	if(random(20)==0) pControls->GetProperty(2)->SetValue(random(2)?"TRIGGERED":"IDLE");
+}
+
+//Devices that haven't finished initial publishing, since boot or their last reconnect. The time to ready
+//histogram only has the ones that did, so this has to be 0 at the end of a run for the percentiles to mean anything.
+int CountNotReady()
+{
+	int notReady=0;
+	for(size_t a=0;a<fleet.size();a++)
+	{
+		if(!fleet[a]->IsInitialPublishingDone()) notReady++;
+	}
+	return notReady;
+}
+
+void Report()
+{
+	uint32_t publishes=0;
+	uint32_t failed=0;
+	uint32_t deferred=0;
+	uint32_t reconnects=0;
+	int connected=0;
+	int connections=0;
+	unsigned long stalls=0;
+	unsigned long topicBytes=0;
+	unsigned long aliasSavable=0;
+	HomieHistogram timeToReady;
+	memset(&timeToReady,0,sizeof(timeToReady));
+
+	for(size_t a=0;a<fleet.size();a++)
+	{
+		HomieMetrics & metrics=fleet[a]->metrics;
+		publishes+=metrics.GetCounter(homieCounterPublish);
+		failed+=metrics.GetCounter(homieCounterPublishFailed);
+		deferred+=metrics.GetCounter(homieCounterPublishDeferred);
+		reconnects+=metrics.GetCounter(homieCounterReconnect);
+
+		if(!fleet[a]->IsVirtual())	//aliases and health belong to the connection
+		{
+			connections++;
+			if(fleet[a]->IsConnected()) connected++;
+			stalls+=fleet[a]->health.GetStalls();
+			topicBytes+=fleet[a]->topicAliases.GetTopicBytes();
+			aliasSavable+=fleet[a]->topicAliases.GetBytesSavable();
+		}
+
+		//the buckets line up, so the fleet's histogram is the sum
+		const HomieHistogram & histogram=metrics.GetHistogram(homieHistogramTimeToReady_ms);
+		for(int i=0;i<HOMIE_HISTOGRAM_BUCKETS;i++) timeToReady.bucket[i]+=histogram.bucket[i];
+		timeToReady.count+=histogram.count;
+		if(histogram.max>timeToReady.max) timeToReady.max=histogram.max;
+	}
+
+	Serial.printf("%lu ms: %.1f publishes/s, %u failed, %u deferred, %u reconnects\n",millis(),
+		(publishes-ulLastPublishes)*1000.0/reportInterval_ms,(unsigned int)failed,(unsigned int)deferred,(unsigned int)reconnects);
+	Serial.printf("  %i of %i connections up, %lu stalls, %ld bytes heap in use\n",connected,connections,stalls,HeapInUse());
+	int notReady=CountNotReady();
+	Serial.printf("  %i of %u devices not ready%s\n",notReady,(unsigned int)fleet.size(),notReady?" (NOT READY)":"");
+	Serial.printf("  time to ready over %u rounds that got ready: p50 %u ms, p90 %u ms, p99 %u ms, max %u ms\n",(unsigned int)timeToReady.count,
+		(unsigned int)timeToReady.GetPercentile(50),(unsigned int)timeToReady.GetPercentile(90),(unsigned int)timeToReady.GetPercentile(99),(unsigned int)timeToReady.max);
+	Serial.printf("  %lu value topic bytes, MQTT 5 topic aliases would save %lu\n",topicBytes,aliasSavable);
+
+	ulLastPublishes=publishes;
+}
+
+//Points every connection at another port, they pick it up on their next connect
+void SetBrokerPort(uint16_t port)
+{
+	for(size_t a=0;a<fleet.size();a++)
+	{
+		if(fleet[a]->IsVirtual()) continue;
+		fleet[a]->setServer(MQTT_HOST,port,MQTT_USER,MQTT_PASS);
+		fleet[a]->mqtt.disconnect(true);
+	}
+}
+
+void RunScenarios()
+{
+	unsigned long uptime=millis()-ulStartTimestamp;
+	switch(scenarioStep)
+	{
+	case 0:
+		if(uptime<brokerDownAt_ms) return;
+		if(brokerDownFor_ms)
+		{
+			Serial.printf("Broker down for %lu s\n",brokerDownFor_ms/1000);
+			SetBrokerPort(mqttDeadPort);
+		}
+		break;
+	case 1:
+		if(uptime<brokerDownAt_ms+brokerDownFor_ms) return;
+		if(brokerDownFor_ms)
+		{
+			Serial.printf("Broker back\n");
+			SetBrokerPort(1883);
+		}
+		break;
+	case 2:
+		if(uptime<slowAckAt_ms) return;
+		if(slowAckFor_ms)
+		{
+			Serial.printf("Acknowledgements take %lu ms for %lu s\n",slowAck_ms,slowAckFor_ms/1000);
+#ifdef HOST_BROKER
+			hostBroker.ackDelay_ms=slowAck_ms;
+#else
+			Serial.printf("  a real broker needs a delay on its link, e.g. tc qdisc add dev eth0 root netem delay %lums\n",slowAck_ms);
+#endif
+		}
+		break;
+	case 3:
+		if(uptime<slowAckAt_ms+slowAckFor_ms) return;
+		if(slowAckFor_ms)
+		{
+			Serial.printf("Acknowledgements back to normal\n");
+#ifdef HOST_BROKER
+			hostBroker.ackDelay_ms=0;
+#endif
+		}
+		break;
+	default:
+		return;
+	}
+	scenarioStep++;
+}
+
+void setup()
+{
+	Serial.begin(115200);
+
+	WiFi.mode(WIFI_STA);
+	WiFi.begin(STASSID,STAPSK);
+	while(WiFi.status()!=WL_CONNECTED) delay(500);
+
+	HomieLibRegisterDebugPrintCallback([](const char * szText){
+		Serial.printf("%s",szText);
+		});
+	HomieLibSetLogLevel(homieLogWarning);
+
+	BuildSchema();
+
+#if defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
+	heapAtBoot=ESP.getFreeHeap();
+#endif
+#ifdef HOST_BROKER
+	hostBroker.downPort=mqttDeadPort;
+#endif
+
+	long heapBefore=HeapInUse();
+
+	fleet.reserve(fleetSize);
+	for(int a=0;a<fleetSize;a++)
+	{
+		HOMIE_ALLOC_SCOPE(homieAllocTree);	//so a profiling build counts the device objects too
+		HomieDevice * pDevice=new HomieDevice;
+
+		char szId[32];
+		snprintf(szId,sizeof(szId),"fleet-%04d",a);
+		pDevice->id=szId;
+		pDevice->friendlyName=szId;
+		pDevice->statsInterval_ms=60000;
+		pDevice->iInitialPublishingThrottle_ms=initialPublishingThrottle_ms;
+
+		if(!HomieSchemaLoad(*pDevice,schema.data(),schema.size()))
+		{
+			Serial.printf("Schema load failed\n");
+			return;
+		}
+
+		if(bSharedConnection && a>0)
+		{
+			pDevice->SetGateway(fleet[0]);
+		}
+		else
+		{
+			pDevice->iGatewayStepsPerTick=gatewayStepsPerTick;
+			pDevice->setServer(MQTT_HOST,1883,MQTT_USER,MQTT_PASS);
+			pDevice->mqtt.setClientId(pDevice->id.c_str());	//brokers drop clients with duplicate ids
+			pDevice->topicAliases.bEnabled=true;	//estimate what MQTT 5 topic aliases would save
+		}
+
+		fleet.push_back(pDevice);
+	}
+
+	for(size_t a=0;a<fleet.size();a++) fleet[a]->Init();
+
+	long heapAfter=HeapInUse();
+	Serial.printf("%i devices from a %u byte schema, %s connection, %ld bytes heap per device\n",fleetSize,(unsigned int)schema.size(),
+		bSharedConnection?"shared":"one",heapBefore>=0?(heapAfter-heapBefore)/fleetSize:-1);
+
+	ulStartTimestamp=ulUpdateTimestamp=ulReportTimestamp=ulReconnectTimestamp=ulBurstTimestamp=millis();
+}
+
+void loop()
+{
+	//with a shared connection the gateway loops its virtual devices
+	for(size_t a=0;a<(bSharedConnection?1:fleet.size()) && a<fleet.size();a++) fleet[a]->Loop();
+
+	//spread the updates over the interval instead of sending them all in one go, a big fleet needs several per ms
+	unsigned long elapsed=millis()-ulUpdateTimestamp;
+	ulUpdateTimestamp+=elapsed;
+	ulUpdateCredit+=elapsed*fleet.size();
+	if(ulUpdateCredit>updateInterval_ms*fleet.size()) ulUpdateCredit=updateInterval_ms*fleet.size();	//no catching up after a stall
+	for(;fleet.size() && ulUpdateCredit>=updateInterval_ms;ulUpdateCredit-=updateInterval_ms)
+	{
+		UpdateDevice(fleet[iNextDevice]);
+		iNextDevice=(iNextDevice+1)%fleet.size();
+	}
+
+	RunScenarios();
+
+	if(burstInterval_ms && millis()-ulBurstTimestamp>=burstInterval_ms)
+	{
+		ulBurstTimestamp=millis();
+		for(size_t a=0;a<fleet.size();a++) UpdateDevice(fleet[a]);
+	}
+
+	if(reconnectInterval_ms && millis()-ulReconnectTimestamp>=reconnectInterval_ms)
+	{
+		ulReconnectTimestamp=millis();
+		Serial.printf("Reconnect storm\n");
+		for(size_t a=0;a<fleet.size();a++)
+		{
+			if(!fleet[a]->IsVirtual()) fleet[a]->mqtt.disconnect(true);
+		}
+	}
+
+	if(millis()-ulReportTimestamp>=reportInterval_ms)
+	{
+		ulReportTimestamp=millis();
+		Report();
+	}
+}
@@ -94,6 +94,7 @@ void setup() {
 		pProp->retained=false;
 		pProp->datatype=homieEnum;
 		pProp->strFormat="PRESSED,RELEASED";
+		pProp->lane=homieLaneUrgent;	//rings go out ahead of everything else, even while the device is still publishing its attributes
 
 		pPropDoorSensor=pProp=pNode->NewProperty();
 		pProp->friendlyName="Door Open";
@@ -217,9 +218,8 @@ void setup() {
 	homie.id="ExampleHomieDev";
 	homie.id.toLowerCase();
 
-	homie.strMqttServerIP=MQTT_HOST;
-	homie.strMqttUserName=MQTT_USER;
-	homie.strMqttPassword=MQTT_PASS;
+	homie.setServer(MQTT_HOST, 1883, MQTT_USER, MQTT_PASS);
+//	homie.addServer("192.168.1.3", 1883, MQTT_USER, MQTT_PASS);	//fallback broker, used while the first one is down
 
 	homie.Init();
 
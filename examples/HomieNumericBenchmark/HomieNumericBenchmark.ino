@@ -0,0 +1,118 @@
+/*
+    This sketch compares the library's numeric payload codec with the libc/String functions it replaced.
+    No network needed, just open the serial monitor.
+*/
+
+#include <LeifHomieLib.h>
+
+const int iterations=10000;
+
+volatile int32_t iSink=0;
+volatile double fSink=0;
+
+const char * szInts[]={"0","42","-17","100","65535","-2147483648"};
+const char * szFloats[]={"0.0","26.3","-64","3.14159","1e-3","12345.678"};
+const double fValues[]={0.0,26.3,-64.0,3.14159,0.001,12345.678};
+
+#define COUNT(x) (sizeof(x)/sizeof(x[0]))
+
+void Report(const char * szName, unsigned long ulStart)
+{
+	unsigned long ulElapsed=micros()-ulStart;
+	Serial.printf("%-28s %8lu us  %6.3f us/op\n",szName,ulElapsed,(double)ulElapsed/iterations);
+}
+
+void setup()
+{
+	Serial.begin(115200);
+	delay(1000);
+	Serial.println();
+
+	unsigned long ulStart;
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++) iSink=atoi(szInts[a%COUNT(szInts)]);
+	Report("atoi",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		const char * szIn=szInts[a%COUNT(szInts)];
+		int32_t value;
+		if(HomieParseInt(szIn,strlen(szIn),value)) iSink=value;
+	}
+	Report("HomieParseInt",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++) fSink=atof(szFloats[a%COUNT(szFloats)]);
+	Report("atof",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		const char * szIn=szFloats[a%COUNT(szFloats)];
+		double value;
+		if(HomieParseFloat(szIn,strlen(szIn),value)) fSink=value;
+	}
+	Report("HomieParseFloat",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		int r,g,b;
+		if(sscanf("255,128,7","%d,%d,%d",&r,&g,&b)==3) iSink=r+g+b;
+	}
+	Report("sscanf %d,%d,%d",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		int32_t c[3];
+		if(HomieParseTriplet("255,128,7",9,c)) iSink=c[0]+c[1]+c[2];
+	}
+	Report("HomieParseTriplet",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		String strTemp(a);
+		iSink=strTemp.length();
+	}
+	Report("String(int)",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		char szTemp[HOMIE_NUMERIC_BUFFER];
+		iSink=HomieFormatInt(szTemp,sizeof(szTemp),a);
+	}
+	Report("HomieFormatInt",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		String strTemp(fValues[a%COUNT(fValues)]);
+		iSink=strTemp.length();
+	}
+	Report("String(double), 2 decimals",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		char szTemp[HOMIE_NUMERIC_BUFFER];
+		iSink=HomieFormatFloat(szTemp,sizeof(szTemp),fValues[a%COUNT(fValues)],2);
+	}
+	Report("HomieFormatFloat, 2 decimals",ulStart);
+
+	ulStart=micros();
+	for(int a=0;a<iterations;a++)
+	{
+		char szTemp[HOMIE_NUMERIC_BUFFER];
+		iSink=HomieFormatFloat(szTemp,sizeof(szTemp),fValues[a%COUNT(fValues)]);
+	}
+	Report("HomieFormatFloat, shortest",ulStart);
+}
+
+void loop()
+{
+}
@@ -0,0 +1,204 @@
+//Static memory mode must not allocate once the device is up. This drives every steady-state path (SetValue and
+//friends, /set dispatch, retained restore, standard MQTT topics, stats, heartbeats, topic alias rebalancing and
+//a reconnect with its initial publishing) with every allocation counted, and fails if there was any.
+//Run with `make test`.
+
+#include <LeifHomieLib.h>
+
+static HomieDevice homie;
+
+static HomieProperty *pInt;
+static HomieProperty *pFloat;
+static HomieProperty *pBool;
+static HomieProperty *pEnum;
+static HomieProperty *pColor;
+static HomieProperty *pString;
+static HomieProperty *pSetpoint;
+static HomieProperty *pLevel;
+static HomieProperty *pStandard;
+
+static unsigned long callbacks = 0;
+static bool bReporting = false; //only the allocation report is printed, not the library's log
+
+static HomieProperty *NewProperty(HomieNode *pNode, const char *id, eHomieDataType datatype)
+{
+	HomieProperty *pProp = pNode->NewProperty();
+	pProp->id = id;
+	pProp->friendlyName = id;
+	pProp->datatype = datatype;
+	pProp->AddCallback([](HomieProperty *) { callbacks++; });
+	return pProp;
+}
+
+static void BuildTree()
+{
+	HomieNode *pNode = homie.NewNode();
+	pNode->id = "sensor";
+	pNode->friendlyName = "Sensor";
+
+	pInt = NewProperty(pNode, "count", homieInt);
+	pInt->strFormat = "0:1000000";
+	pFloat = NewProperty(pNode, "temperature", homieFloat);
+	pBool = NewProperty(pNode, "open", homieBool);
+	pEnum = NewProperty(pNode, "mode", homieEnum);
+	pEnum->strFormat = "off,heat,cool";
+	pColor = NewProperty(pNode, "light", homieColor);
+	pColor->strFormat = "rgb";
+	pString = NewProperty(pNode, "status", homieString);
+	pString->publishMode = homiePublishOnChangeOrHeartbeat;
+	pString->heartbeat_ms = 50;
+
+	pSetpoint = NewProperty(pNode, "setpoint", homieFloat);
+	pSetpoint->settable = true;
+	pSetpoint->retained = true;
+
+	pNode = homie.NewNode();
+	pNode->id = "channel";
+	pNode->friendlyName = "Channel";
+	pNode->SetArray(4);
+	pLevel = NewProperty(pNode, "level", homieInt);
+	pLevel->settable = true;
+
+	pStandard = NewProperty(pNode = homie.NewNode(), "relay", homieString);
+	pNode->id = "legacy";
+	pStandard->SetStandardMQTT("legacy/relay");
+}
+
+static void LoopFor(unsigned long duration_ms)
+{
+	unsigned long start = millis();
+	while (millis() - start < duration_ms)
+	{
+		homie.Loop();
+		hostBroker.Loop();
+		delay(1);
+	}
+}
+
+static bool WaitReady(unsigned long readies)
+{
+	unsigned long start = millis();
+	while (hostBroker.readies < readies)
+	{
+		if (millis() - start > 5000)
+			return false;
+		homie.Loop();
+		hostBroker.Loop();
+		delay(1);
+	}
+	return true;
+}
+
+static void SteadyState()
+{
+	//restores the setpoint the first time, later it's one of ours coming back
+	hostBroker.Deliver(homie.mqtt, "homie/alloc-test/sensor/setpoint", "21.5", true);
+
+	char szTemp[32];
+	for (int i = 0; i < 1000; i++)
+	{
+		pInt->SetInt(i);
+		pFloat->SetFloat(20 + i * 0.01);
+		pBool->SetBool(i & 1);
+		pEnum->SetValue((i & 1) ? "heat" : "cool");
+		pColor->SetValue((i & 1) ? "255,0,0" : "0,0,255");
+		snprintf(szTemp, sizeof(szTemp), "step %i", i);
+		pString->SetValue(szTemp);
+
+		snprintf(szTemp, sizeof(szTemp), "%i.5", i % 30);
+		hostBroker.Deliver(homie.mqtt, "homie/alloc-test/sensor/setpoint/set", szTemp);
+		snprintf(szTemp, sizeof(szTemp), "%i", i);
+		hostBroker.Deliver(homie.mqtt, "homie/alloc-test/channel_2/level/set", szTemp);
+		hostBroker.Deliver(homie.mqtt, "legacy/relay", (i & 1) ? "ON" : "OFF");
+		hostBroker.Deliver(homie.mqtt, "homie/alloc-test/sensor/nothing/set", "1");
+		hostBroker.Deliver(homie.mqtt, "homie/alloc-test/sensor/count/set", "not settable");
+		hostBroker.Deliver(homie.mqtt, "homie/alloc-test/sensor/count", "our echo");
+
+		if (!(i % 100))
+		{
+			homie.Loop();
+			hostBroker.Loop();
+		}
+	}
+
+	LoopFor(300); //stats, heartbeats and the ready republish
+}
+
+static void Reconnect()
+{
+	unsigned long readies = hostBroker.readies;
+	hostBroker.DisconnectAll();
+	WaitReady(readies + 1);
+}
+
+static unsigned long CountAllocations()
+{
+	unsigned long allocations = 0;
+	for (int site = 0; site < homieAllocSiteCount; site++)
+	{
+		allocations += HomieAllocGetStats((eHomieAllocSite)site).allocations;
+	}
+	return allocations;
+}
+
+static bool Check(const char *szName, void (*run)())
+{
+	HomieAllocReset();
+	{
+		HOMIE_ALLOC_SCOPE(homieAllocDispatch); //catches what no library scope covers, inner scopes still attribute
+		run();
+	}
+
+	unsigned long allocations = CountAllocations();
+	printf("%-14s %lu allocations\n", szName, allocations);
+	if (allocations)
+	{
+		bReporting = true;
+		HomieAllocReport();
+		bReporting = false;
+	}
+	return !allocations;
+}
+
+int main()
+{
+	homie.id = "alloc-test";
+	homie.friendlyName = "Allocation test";
+	homie.bStaticMemory = true;
+	homie.statsInterval_ms = 100;
+	homie.iInitialPublishingThrottle_ms = 0;
+	homie.health.backoffBase_ms = 5;
+	homie.topicAliases.bEnabled = true; //its rebalance runs in the loop too
+	homie.topicAliases.rebalanceInterval_ms = 50;
+	homie.setServer("localhost", 1883);
+
+	HomieLibRegisterDebugPrintCallback([](const char *szText) {
+		if (bReporting)
+			fputs(szText, stdout);
+	});
+
+	BuildTree();
+	homie.Init();
+
+	//the first connect fills the dispatch map and sizes the lists, that may allocate
+	if (!WaitReady(1))
+	{
+		printf("initial publishing didn't finish\n");
+		return 1;
+	}
+	LoopFor(200);
+
+	bool bPassed = true;
+	bPassed &= Check("steady state", SteadyState);
+	bPassed &= Check("reconnect", Reconnect);
+	bPassed &= Check("steady state", SteadyState);
+
+	//and nothing got lost on the way
+	printf("%lu publishes, %lu callbacks\n", hostBroker.publishes, callbacks);
+	bPassed &= callbacks == 1 + 2 * 3000;
+	bPassed &= pSetpoint->GetValue() == "9.5" && pLevel->GetArrayInt(2) == 999 && pStandard->GetValue() == "ON";
+	printf(bPassed ? "PASS\n" : "FAIL\n");
+
+	homie.Quit(); //before the library's statics go away at exit
+	return bPassed ? 0 : 1;
+}
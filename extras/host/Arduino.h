@@ -0,0 +1,134 @@
+#pragma once
+//Just enough of the Arduino core to build the library and its examples on a PC, see Makefile
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <functional>
+
+unsigned long millis();
+unsigned long micros();
+long random(long howbig);
+long random(long howsmall, long howbig);
+void delay(unsigned long ms);
+void yield();
+
+#define PROGMEM
+#define PSTR(x) x
+#define F(x) x
+
+//Arduino String. Like the real one it lives in one malloc'd buffer that assigning keeps and concat grows with
+//realloc, without a small string buffer, so every heap use shows up in the allocation profiler.
+class String
+{
+public:
+	String(const char *sz = "") { Assign(sz, sz ? strlen(sz) : 0); }
+	String(const String &other) { Assign(other.buffer, other.len); }
+	String(char c) { Assign(&c, 1); }
+	explicit String(int value);
+	explicit String(unsigned int value);
+	explicit String(long value);
+	explicit String(unsigned long value);
+	explicit String(double value, unsigned char decimals = 2);
+	~String() { free(buffer); }
+
+	String &operator=(const String &other)
+	{
+		if (this != &other)
+			Assign(other.buffer, other.len);
+		return *this;
+	}
+	String &operator=(const char *sz)
+	{
+		Assign(sz, sz ? strlen(sz) : 0);
+		return *this;
+	}
+
+	const char *c_str() const { return buffer ? buffer : ""; }
+	unsigned int length() const { return len; }
+	unsigned char reserve(unsigned int size);
+
+	unsigned char concat(const char *sz, unsigned int length);
+	unsigned char concat(const String &other) { return concat(other.c_str(), other.len); }
+	unsigned char concat(const char *sz) { return concat(sz, strlen(sz)); }
+	unsigned char concat(char c) { return concat(&c, 1); }
+	String &operator+=(const String &other)
+	{
+		concat(other);
+		return *this;
+	}
+	String &operator+=(const char *sz)
+	{
+		concat(sz);
+		return *this;
+	}
+	String &operator+=(char c)
+	{
+		concat(c);
+		return *this;
+	}
+
+	friend String operator+(const String &a, const String &b) { return String(a) += b; }
+	friend String operator+(const String &a, const char *b) { return String(a) += b; }
+	friend String operator+(const char *a, const String &b) { return String(a) += b; }
+
+	bool equals(const String &other) const { return len == other.len && !memcmp(c_str(), other.c_str(), len); }
+	bool operator==(const String &other) const { return equals(other); }
+	bool operator==(const char *sz) const { return !strcmp(c_str(), sz); }
+	bool operator!=(const String &other) const { return !equals(other); }
+	bool operator!=(const char *sz) const { return !(*this == sz); }
+	bool operator<(const String &other) const { return strcmp(c_str(), other.c_str()) < 0; }
+
+	char operator[](unsigned int index) const { return index < len ? buffer[index] : 0; }
+	char charAt(unsigned int index) const { return (*this)[index]; }
+	int indexOf(char c, unsigned int from = 0) const;
+	int indexOf(const char *sz, unsigned int from = 0) const;
+	int lastIndexOf(char c) const;
+	String substring(unsigned int from) const { return substring(from, len); }
+	String substring(unsigned int from, unsigned int to) const;
+	bool startsWith(const String &prefix) const { return prefix.len <= len && !memcmp(c_str(), prefix.c_str(), prefix.len); }
+	long toInt() const { return atol(c_str()); }
+	float toFloat() const { return (float)atof(c_str()); }
+
+private:
+	char *buffer = NULL;
+	unsigned int capacity = 0;
+	unsigned int len = 0;
+	void Assign(const char *sz, unsigned int length);
+};
+
+class IPAddress
+{
+public:
+	IPAddress() {}
+	IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : octet{a, b, c, d} {}
+	uint8_t operator[](int index) const { return octet[index]; }
+	String toString() const;
+
+private:
+	uint8_t octet[4] = {0, 0, 0, 0};
+};
+
+class EspClass
+{
+public:
+	//the host has no heap statistics, the library's allocation profiler counts instead
+	uint32_t getFreeHeap() { return 0; }
+	uint32_t getMaxFreeBlockSize() { return 0; }
+	uint32_t getMaxAllocHeap() { return 0; }
+	uint32_t getHeapFragmentation() { return 0; }
+};
+extern EspClass ESP;
+
+class HardwareSerial
+{
+public:
+	void begin(unsigned long) {}
+	int printf(const char *szFormat, ...) __attribute__((format(printf, 2, 3)));
+	void print(const char *sz) { fputs(sz, stdout); }
+	void println(const char *sz = "") { puts(sz); }
+};
+extern HardwareSerial Serial;
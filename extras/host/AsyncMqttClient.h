@@ -0,0 +1,102 @@
+#pragma once
+#include "Arduino.h"
+
+//Host stand-in for AsyncMqttClient. There is no network, every client talks to hostBroker below, which can be
+//taken down or made slow to acknowledge. Handlers are appended like in the real client.
+#define HOST_BROKER //sketches can drive hostBroker
+
+enum class AsyncMqttClientDisconnectReason : int8_t
+{
+	TCP_DISCONNECTED = 0,
+};
+
+struct AsyncMqttClientMessageProperties
+{
+	uint8_t qos;
+	bool dup;
+	bool retain;
+};
+
+class AsyncMqttClient
+{
+public:
+	typedef std::function<void(bool sessionPresent)> OnConnectUserCallback;
+	typedef std::function<void(AsyncMqttClientDisconnectReason reason)> OnDisconnectUserCallback;
+	typedef std::function<void(uint16_t packetId, uint8_t qos)> OnSubscribeUserCallback;
+	typedef std::function<void(uint16_t packetId)> OnUnsubscribeUserCallback;
+	typedef std::function<void(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)> OnMessageUserCallback;
+	typedef std::function<void(uint16_t packetId)> OnPublishUserCallback;
+
+	AsyncMqttClient();
+	~AsyncMqttClient();
+
+	AsyncMqttClient &setKeepAlive(uint16_t) { return *this; }
+	AsyncMqttClient &setClientId(const char *) { return *this; }
+	AsyncMqttClient &setCleanSession(bool) { return *this; }
+	AsyncMqttClient &setMaxTopicLength(uint16_t) { return *this; }
+	AsyncMqttClient &setCredentials(const char *, const char * = nullptr) { return *this; }
+	AsyncMqttClient &setWill(const char *, uint8_t, bool, const char * = nullptr, size_t = 0) { return *this; }
+	AsyncMqttClient &setServer(IPAddress, uint16_t port);
+	AsyncMqttClient &setServer(const char *, uint16_t port);
+
+	AsyncMqttClient &onConnect(OnConnectUserCallback callback);
+	AsyncMqttClient &onDisconnect(OnDisconnectUserCallback callback);
+	AsyncMqttClient &onSubscribe(OnSubscribeUserCallback) { return *this; }
+	AsyncMqttClient &onUnsubscribe(OnUnsubscribeUserCallback) { return *this; }
+	AsyncMqttClient &onMessage(OnMessageUserCallback callback);
+	AsyncMqttClient &onPublish(OnPublishUserCallback callback);
+
+	bool connected() const { return bConnected; }
+	void connect();
+	void disconnect(bool force = false);
+	uint16_t subscribe(const char *topic, uint8_t qos);
+	uint16_t unsubscribe(const char *topic);
+	uint16_t publish(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t length = 0, bool dup = false, uint16_t message_id = 0);
+
+private:
+	friend struct HostBroker;
+
+	std::vector<OnConnectUserCallback> vecOnConnect;
+	std::vector<OnDisconnectUserCallback> vecOnDisconnect;
+	std::vector<OnMessageUserCallback> vecOnMessage;
+	std::vector<OnPublishUserCallback> vecOnPublish;
+
+	bool bConnected = false;
+	uint16_t port = 0;
+	uint16_t nextPacketId = 1;
+};
+
+//The broker every host client is connected to. Connects complete at once, PUBACKs arrive in Loop.
+struct HostBroker
+{
+	uint16_t downPort = 0;		 //connects to this port fail, 0 for none
+	bool bDown = false;			 //every connect fails
+	unsigned long ackDelay_ms = 0; //PUBACK delay for QoS 1 and 2 publishes
+
+	unsigned long publishes = 0;
+	unsigned long publishBytes = 0; //topics and payloads
+	unsigned long subscribes = 0;
+	unsigned long readies = 0; //$state=ready publishes, one per completed initial publishing
+
+	void Loop(); //sends the acknowledgements that are due
+	void DisconnectAll();
+
+	//sends a message to one client, as if the broker forwarded it
+	void Deliver(AsyncMqttClient &client, const char *topic, const char *payload, bool retain = false);
+
+	//acknowledgements waiting for their time, a full ring drops them like a lossy link would
+	struct PendingAck
+	{
+		AsyncMqttClient *pClient;
+		uint16_t packetId;
+		unsigned long due;
+	};
+	static const size_t ackRingSize = 4096;
+	PendingAck ackRing[ackRingSize];
+	size_t ackHead = 0;
+	size_t ackCount = 0;
+
+	//sketches construct their clients before main, possibly before hostBroker
+	static std::vector<AsyncMqttClient *> &Clients();
+};
+extern HostBroker hostBroker;
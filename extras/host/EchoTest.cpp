@@ -0,0 +1,68 @@
+//A settable retained property subscribes to its base topic until the controller's retained value arrives, and
+//meanwhile its own publishes come back from the broker. Two quick publishes before the restore must both be
+//recognized as echoes: the property keeps its latest value and no callback fires. Run with `make test`.
+
+#include <LeifHomieLib.h>
+
+static HomieDevice homie;
+static unsigned long callbacks = 0;
+
+static void LoopFor(unsigned long duration_ms)
+{
+	unsigned long start = millis();
+	while (millis() - start < duration_ms)
+	{
+		homie.Loop();
+		hostBroker.Loop();
+		delay(1);
+	}
+}
+
+int main()
+{
+	homie.id = "echo-test";
+	homie.friendlyName = "Echo test";
+	homie.iInitialPublishingThrottle_ms = 0;
+	homie.setServer("localhost", 1883);
+
+	HomieNode *pNode = homie.NewNode();
+	pNode->id = "thermostat";
+	pNode->friendlyName = "Thermostat";
+
+	HomieProperty *pSetpoint = pNode->NewProperty();
+	pSetpoint->id = "setpoint";
+	pSetpoint->friendlyName = "Setpoint";
+	pSetpoint->datatype = homieInt;
+	pSetpoint->settable = true;
+	pSetpoint->retained = true;
+	pSetpoint->AddCallback([](HomieProperty *) { callbacks++; });
+
+	homie.Init();
+	LoopFor(1000);
+	if (!homie.IsInitialPublishingDone())
+	{
+		printf("initial publishing didn't finish\n");
+		return 1;
+	}
+
+	//both go out while the base topic is still subscribed, then the broker sends them back in order
+	pSetpoint->SetInt(1);
+	pSetpoint->SetInt(2);
+	hostBroker.Deliver(homie.mqtt, "homie/echo-test/thermostat/setpoint", "1");
+	hostBroker.Deliver(homie.mqtt, "homie/echo-test/thermostat/setpoint", "2");
+	LoopFor(100);
+
+	bool bPassed = pSetpoint->GetValue() == "2" && callbacks == 0 && homie.GetDroppedEchoes() == 1;
+	printf("value %s, %lu callbacks, %lu echoes dropped\n", pSetpoint->GetValue().c_str(), callbacks, homie.GetDroppedEchoes());
+
+	//a controller's /set is still taken
+	hostBroker.Deliver(homie.mqtt, "homie/echo-test/thermostat/setpoint/set", "21");
+	LoopFor(100);
+	bPassed &= pSetpoint->GetValue() == "21" && callbacks == 1;
+	printf("after /set: value %s, %lu callbacks\n", pSetpoint->GetValue().c_str(), callbacks);
+
+	printf(bPassed ? "PASS\n" : "FAIL\n");
+
+	homie.Quit();
+	return bPassed ? 0 : 1;
+}
@@ -0,0 +1,31 @@
+#include "Arduino.h"
+#include "AsyncMqttClient.h"
+
+//The Arduino runtime for a sketch on the host: setup, then loop for the given seconds, with the broker's
+//acknowledgements delivered in between. See examples/HomieFleetLoad. Fails if any device isn't ready at the end.
+
+void setup();
+void loop();
+int CountNotReady();
+
+int main(int argc, char **argv)
+{
+	unsigned long run_ms = (argc > 1 ? strtoul(argv[1], NULL, 10) : 100) * 1000;
+
+	setup();
+	while (millis() < run_ms)
+	{
+		loop();
+		hostBroker.Loop();
+	}
+
+	int notReady = CountNotReady();
+	if (notReady)
+	{
+		printf("FAIL: %i devices not ready after %lu s\n", notReady, run_ms / 1000);
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
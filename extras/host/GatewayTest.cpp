@@ -0,0 +1,75 @@
+//A gateway and its virtual devices share one connection and its initial publishing steps. This connects a
+//gateway with 99 virtual devices and fails unless all 100 are ready within the time the step budget allows.
+//Run with `make test`.
+
+#include <LeifHomieLib.h>
+
+static const int virtualDevices = 99;
+static const int properties = 5;
+
+static HomieDevice gateway;
+static HomieDevice device[virtualDevices];
+
+static void BuildDevice(HomieDevice &d, const char *id)
+{
+	d.id = id;
+	d.friendlyName = id;
+	d.iInitialPublishingThrottle_ms = 20;
+
+	HomieNode *pNode = d.NewNode();
+	pNode->id = "sensor";
+	pNode->friendlyName = "Sensor";
+
+	for (int a = 0; a < properties; a++)
+	{
+		char szId[16];
+		snprintf(szId, sizeof(szId), "value%d", a);
+		HomieProperty *pProp = pNode->NewProperty();
+		pProp->id = szId;
+		pProp->friendlyName = szId;
+		pProp->datatype = homieInt;
+	}
+}
+
+int main()
+{
+	BuildDevice(gateway, "gateway");
+	gateway.setServer("localhost", 1883);
+
+	for (int a = 0; a < virtualDevices; a++)
+	{
+		char szId[16];
+		snprintf(szId, sizeof(szId), "virtual%02d", a);
+		BuildDevice(device[a], szId);
+		device[a].SetGateway(&gateway);
+	}
+
+	gateway.Init();
+	for (int a = 0; a < virtualDevices; a++)
+		device[a].Init();
+
+	//every device takes about a dozen steps, the connection gets iGatewayStepsPerTick of them per 100ms plus the
+	//gateway's own, so the whole fleet needs about 13s. One step per tick took close to a minute.
+	const unsigned long limit_ms = 25000;
+	unsigned long start = millis();
+	int ready = 0;
+	while (ready < 1 + virtualDevices && millis() - start < limit_ms)
+	{
+		gateway.Loop();
+		hostBroker.Loop();
+		delay(1);
+
+		ready = gateway.IsInitialPublishingDone() ? 1 : 0;
+		for (int a = 0; a < virtualDevices; a++)
+			ready += device[a].IsInitialPublishingDone() ? 1 : 0;
+	}
+
+	unsigned long elapsed = millis() - start;
+
+	bool bPassed = ready == 1 + virtualDevices;
+	printf("%d of %d devices ready after %lu ms, %lu publishes\n", ready, 1 + virtualDevices, elapsed, hostBroker.publishes);
+	printf(bPassed ? "PASS\n" : "FAIL\n");
+
+	gateway.Quit();
+	return bPassed ? 0 : 1;
+}
@@ -0,0 +1,358 @@
+#include "Arduino.h"
+#include "AsyncMqttClient.h"
+#include "WiFi.h"
+#include <algorithm>
+#include <chrono>
+#include <stdarg.h>
+#include <thread>
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+	return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+unsigned long micros()
+{
+	return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+long random(long howbig)
+{
+	return howbig > 0 ? rand() % howbig : 0;
+}
+
+long random(long howsmall, long howbig)
+{
+	return howbig > howsmall ? howsmall + rand() % (howbig - howsmall) : howsmall;
+}
+
+void delay(unsigned long ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield()
+{
+}
+
+unsigned char String::reserve(unsigned int size)
+{
+	if (size <= capacity && buffer)
+		return 1;
+	char *pNew = (char *)realloc(buffer, size + 1);
+	if (!pNew)
+		return 0;
+	if (!buffer)
+		pNew[0] = 0;
+	buffer = pNew;
+	capacity = size;
+	return 1;
+}
+
+void String::Assign(const char *sz, unsigned int length)
+{
+	if (!reserve(length))
+		return;
+	memmove(buffer, sz, length);
+	buffer[length] = 0;
+	len = length;
+}
+
+unsigned char String::concat(const char *sz, unsigned int length)
+{
+	if (!reserve(len + length))
+		return 0;
+	memmove(buffer + len, sz, length);
+	len += length;
+	buffer[len] = 0;
+	return 1;
+}
+
+String::String(int value)
+{
+	char szTemp[16];
+	snprintf(szTemp, sizeof(szTemp), "%d", value);
+	*this = szTemp;
+}
+
+String::String(unsigned int value)
+{
+	char szTemp[16];
+	snprintf(szTemp, sizeof(szTemp), "%u", value);
+	*this = szTemp;
+}
+
+String::String(long value)
+{
+	char szTemp[24];
+	snprintf(szTemp, sizeof(szTemp), "%ld", value);
+	*this = szTemp;
+}
+
+String::String(unsigned long value)
+{
+	char szTemp[24];
+	snprintf(szTemp, sizeof(szTemp), "%lu", value);
+	*this = szTemp;
+}
+
+String::String(double value, unsigned char decimals)
+{
+	char szTemp[64];
+	snprintf(szTemp, sizeof(szTemp), "%.*f", decimals, value);
+	*this = szTemp;
+}
+
+int String::indexOf(char c, unsigned int from) const
+{
+	const char *p = from < len ? strchr(buffer + from, c) : NULL;
+	return p ? (int)(p - buffer) : -1;
+}
+
+int String::indexOf(const char *sz, unsigned int from) const
+{
+	const char *p = from < len ? strstr(buffer + from, sz) : NULL;
+	return p ? (int)(p - buffer) : -1;
+}
+
+int String::lastIndexOf(char c) const
+{
+	const char *p = len ? strrchr(buffer, c) : NULL;
+	return p ? (int)(p - buffer) : -1;
+}
+
+String String::substring(unsigned int from, unsigned int to) const
+{
+	String ret;
+	if (from < to && from < len)
+		ret.Assign(buffer + from, (to < len ? to : len) - from);
+	return ret;
+}
+
+String IPAddress::toString() const
+{
+	char szTemp[16];
+	snprintf(szTemp, sizeof(szTemp), "%u.%u.%u.%u", octet[0], octet[1], octet[2], octet[3]);
+	return String(szTemp);
+}
+
+EspClass ESP;
+
+HardwareSerial Serial;
+
+int HardwareSerial::printf(const char *szFormat, ...)
+{
+	va_list args;
+	va_start(args, szFormat);
+	int ret = vprintf(szFormat, args);
+	va_end(args);
+	return ret;
+}
+
+WiFiClass WiFi;
+
+uint8_t *WiFiClass::macAddress(uint8_t *mac)
+{
+	static const uint8_t hostMac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01}; //locally administered
+	memcpy(mac, hostMac, sizeof(hostMac));
+	return mac;
+}
+
+String WiFiClass::macAddress()
+{
+	uint8_t mac[6];
+	macAddress(mac);
+	char szTemp[18];
+	snprintf(szTemp, sizeof(szTemp), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	return String(szTemp);
+}
+
+HostBroker hostBroker;
+
+std::vector<AsyncMqttClient *> &HostBroker::Clients()
+{
+	static std::vector<AsyncMqttClient *> vecClient;
+	return vecClient;
+}
+
+AsyncMqttClient::AsyncMqttClient()
+{
+	HostBroker::Clients().push_back(this);
+}
+
+AsyncMqttClient::~AsyncMqttClient()
+{
+	std::vector<AsyncMqttClient *> &vec = HostBroker::Clients();
+	vec.erase(std::remove(vec.begin(), vec.end(), this), vec.end());
+
+	//forget acknowledgements still on their way to us
+	for (size_t i = 0; i < hostBroker.ackCount; i++)
+	{
+		HostBroker::PendingAck &ack = hostBroker.ackRing[(hostBroker.ackHead + i) % HostBroker::ackRingSize];
+		if (ack.pClient == this)
+			ack.pClient = NULL;
+	}
+}
+
+AsyncMqttClient &AsyncMqttClient::setServer(IPAddress, uint16_t port)
+{
+	this->port = port;
+	return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::setServer(const char *, uint16_t port)
+{
+	this->port = port;
+	return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onConnect(OnConnectUserCallback callback)
+{
+	vecOnConnect.push_back(callback);
+	return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onDisconnect(OnDisconnectUserCallback callback)
+{
+	vecOnDisconnect.push_back(callback);
+	return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onMessage(OnMessageUserCallback callback)
+{
+	vecOnMessage.push_back(callback);
+	return *this;
+}
+
+AsyncMqttClient &AsyncMqttClient::onPublish(OnPublishUserCallback callback)
+{
+	vecOnPublish.push_back(callback);
+	return *this;
+}
+
+void AsyncMqttClient::connect()
+{
+	if (bConnected)
+		return;
+
+	if (hostBroker.bDown || (hostBroker.downPort && port == hostBroker.downPort))
+	{
+		for (size_t i = 0; i < vecOnDisconnect.size(); i++)
+			vecOnDisconnect[i](AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+		return;
+	}
+
+	bConnected = true;
+	for (size_t i = 0; i < vecOnConnect.size(); i++)
+		vecOnConnect[i](false);
+}
+
+void AsyncMqttClient::disconnect(bool)
+{
+	if (!bConnected)
+		return;
+
+	bConnected = false;
+	for (size_t i = 0; i < vecOnDisconnect.size(); i++)
+		vecOnDisconnect[i](AsyncMqttClientDisconnectReason::TCP_DISCONNECTED);
+}
+
+uint16_t AsyncMqttClient::subscribe(const char *, uint8_t)
+{
+	if (!bConnected)
+		return 0;
+	hostBroker.subscribes++;
+	return 1;
+}
+
+uint16_t AsyncMqttClient::unsubscribe(const char *)
+{
+	return bConnected ? 1 : 0;
+}
+
+uint16_t AsyncMqttClient::publish(const char *topic, uint8_t qos, bool, const char *payload, size_t length, bool, uint16_t)
+{
+	if (!bConnected)
+		return 0;
+
+	if (payload && !length)
+		length = strlen(payload);
+
+	hostBroker.publishes++;
+	hostBroker.publishBytes += strlen(topic) + length;
+
+	size_t topicLength = strlen(topic);
+	if (length == 5 && !memcmp(payload, "ready", 5) && topicLength >= 7 && !strcmp(topic + topicLength - 7, "/$state"))
+		hostBroker.readies++;
+
+	if (!qos)
+		return 1;
+
+	uint16_t packetId = nextPacketId++;
+	if (!nextPacketId)
+		nextPacketId = 1;
+
+	if (hostBroker.ackCount < HostBroker::ackRingSize)
+	{
+		HostBroker::PendingAck &ack = hostBroker.ackRing[(hostBroker.ackHead + hostBroker.ackCount) % HostBroker::ackRingSize];
+		ack.pClient = this;
+		ack.packetId = packetId;
+		ack.due = millis() + hostBroker.ackDelay_ms;
+		hostBroker.ackCount++;
+	}
+
+	return packetId;
+}
+
+void HostBroker::Loop()
+{
+	//in order, so raising ackDelay_ms holds back what's behind like a congested link would
+	while (ackCount)
+	{
+		PendingAck &ack = ackRing[ackHead];
+		if ((long)(millis() - ack.due) < 0)
+			break;
+
+		PendingAck done = ack;
+		ackHead = (ackHead + 1) % ackRingSize;
+		ackCount--;
+
+		if (done.pClient && done.pClient->bConnected)
+		{
+			for (size_t i = 0; i < done.pClient->vecOnPublish.size(); i++)
+				done.pClient->vecOnPublish[i](done.packetId);
+		}
+	}
+}
+
+void HostBroker::DisconnectAll()
+{
+	std::vector<AsyncMqttClient *> &vec = Clients();
+	for (size_t i = 0; i < vec.size(); i++)
+		vec[i]->disconnect(true);
+}
+
+void HostBroker::Deliver(AsyncMqttClient &client, const char *topic, const char *payload, bool retain)
+{
+	if (!client.bConnected)
+		return;
+
+	//the real client hands out writable buffers
+	char szTopic[256];
+	char szPayload[512];
+	snprintf(szTopic, sizeof(szTopic), "%s", topic);
+	size_t len = strlen(payload);
+	if (len > sizeof(szPayload))
+		len = sizeof(szPayload);
+	memcpy(szPayload, payload, len);
+
+	AsyncMqttClientMessageProperties properties;
+	properties.qos = 1;
+	properties.dup = false;
+	properties.retain = retain;
+
+	for (size_t i = 0; i < client.vecOnMessage.size(); i++)
+		client.vecOnMessage[i](szTopic, szPayload, properties, len, 0, len);
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include "Arduino.h"
+
+//The host is always online
+#define WIFI_STA 1
+#define WL_CONNECTED 3
+
+class WiFiClass
+{
+public:
+	void mode(int) {}
+	void begin(const char *, const char *) {}
+	int status() { return WL_CONNECTED; }
+	int RSSI() { return -50; }
+	IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+	uint8_t *macAddress(uint8_t *mac);
+	String macAddress();
+};
+extern WiFiClass WiFi;
@@ -0,0 +1,252 @@
+#include "HomieAlloc.h"
+#include "HomieLog.h"
+
+#if defined(HOMIELIB_ALLOC_PROFILE) && !defined(ARDUINO_ARCH_ESP8266) && !defined(ARDUINO_ARCH_ESP32)
+#define HOMIELIB_ALLOC_HOST
+#include <cstddef>
+#include <new>
+#endif
+
+#if defined(HOMIELIB_ALLOC_HOST) && defined(HOMIELIB_ALLOC_WRAP_MALLOC)
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t count, size_t size);
+extern "C" void *__real_realloc(void *p, size_t size);
+extern "C" void __real_free(void *p);
+#define HOMIE_RAW_MALLOC __real_malloc
+#define HOMIE_RAW_FREE __real_free
+#else
+#define HOMIE_RAW_MALLOC malloc
+#define HOMIE_RAW_FREE free
+#endif
+
+static HomieAllocStats allocStats[homieAllocSiteCount];
+static size_t minLargestBlock = 0;
+
+#ifdef HOMIELIB_ALLOC_PROFILE
+
+static void RecordGrowth(eHomieAllocSite site, long bytes)
+{
+	HomieAllocStats &stats = allocStats[site];
+	if (bytes > 0)
+		stats.bytes += bytes;
+	stats.retained += bytes;
+	if (stats.retained > stats.peak)
+		stats.peak = stats.retained;
+}
+
+//the loop or worker and the network task each have their own scope chain
+#if defined(ARDUINO_ARCH_ESP8266)
+static HomieAllocScope *pActiveScope = NULL;
+#else
+static thread_local HomieAllocScope *pActiveScope = NULL;
+#endif
+
+static uint32_t GetFreeHeap()
+{
+#ifdef HOMIELIB_ALLOC_HOST
+	return 0;
+#else
+	return ESP.getFreeHeap();
+#endif
+}
+
+HomieAllocScope::HomieAllocScope(eHomieAllocSite siteIn) : site(siteIn), pOuter(pActiveScope), freeHeap(GetFreeHeap())
+{
+	allocStats[site].calls++;
+	pActiveScope = this;
+}
+
+HomieAllocScope::~HomieAllocScope()
+{
+	pActiveScope = pOuter;
+
+#ifndef HOMIELIB_ALLOC_HOST
+	long growth = (long)freeHeap - (long)GetFreeHeap();
+	RecordGrowth(site, growth - innerGrowth);
+	if (pOuter)
+		pOuter->innerGrowth += growth;
+
+#if defined(ARDUINO_ARCH_ESP8266)
+	size_t largest = ESP.getMaxFreeBlockSize();
+#else
+	size_t largest = ESP.getMaxAllocHeap();
+#endif
+	if (!minLargestBlock || largest < minLargestBlock)
+		minLargestBlock = largest;
+#endif
+}
+
+#endif
+
+#ifdef HOMIELIB_ALLOC_HOST
+
+//Every allocation carries its size and site in front so the free can credit the right site. The magic tells our
+//blocks from ones libc allocated internally and hands back to be freed.
+struct HomieAllocHeader
+{
+	size_t size;
+	int site;
+	uint32_t magic;
+};
+
+static const uint32_t allocMagic = 0x484f4d45;
+static const size_t allocHeaderSize = (sizeof(HomieAllocHeader) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+
+static void *Track(void *pRaw, size_t size)
+{
+	HomieAllocHeader *pHeader = (HomieAllocHeader *)pRaw;
+	pHeader->size = size;
+	pHeader->site = pActiveScope ? (int)pActiveScope->GetSite() : -1;
+	pHeader->magic = allocMagic;
+
+	if (pHeader->site >= 0)
+	{
+		allocStats[pHeader->site].allocations++;
+		RecordGrowth((eHomieAllocSite)pHeader->site, (long)size);
+	}
+
+	return (uint8_t *)pRaw + allocHeaderSize;
+}
+
+static HomieAllocHeader *Untrack(void *p)
+{
+	HomieAllocHeader *pHeader = (HomieAllocHeader *)((uint8_t *)p - allocHeaderSize);
+	if (pHeader->magic != allocMagic)
+		return NULL;
+
+	if (pHeader->site >= 0)
+		allocStats[pHeader->site].retained -= (long)pHeader->size;
+	pHeader->magic = 0;
+	return pHeader;
+}
+
+void *operator new(size_t size)
+{
+	void *p = HOMIE_RAW_MALLOC(size + allocHeaderSize);
+	if (!p)
+		throw std::bad_alloc();
+	return Track(p, size);
+}
+
+void operator delete(void *p) noexcept
+{
+	if (!p)
+		return;
+	HomieAllocHeader *pHeader = Untrack(p);
+	HOMIE_RAW_FREE(pHeader ? (void *)pHeader : p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+#ifdef HOMIELIB_ALLOC_WRAP_MALLOC
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+	void *p = __real_malloc(size + allocHeaderSize);
+	return p ? Track(p, size) : NULL;
+}
+
+extern "C" void *__wrap_calloc(size_t count, size_t size)
+{
+	if (size && count > ((size_t)-1 - allocHeaderSize) / size)
+		return NULL;
+	void *p = __real_calloc(1, count * size + allocHeaderSize);
+	return p ? Track(p, count * size) : NULL;
+}
+
+extern "C" void __wrap_free(void *p)
+{
+	if (!p)
+		return;
+	HomieAllocHeader *pHeader = Untrack(p);
+	__real_free(pHeader ? (void *)pHeader : p);
+}
+
+extern "C" void *__wrap_realloc(void *p, size_t size)
+{
+	if (!p)
+		return __wrap_malloc(size);
+	if (!size)
+	{
+		__wrap_free(p);
+		return NULL;
+	}
+
+	HomieAllocHeader *pHeader = (HomieAllocHeader *)((uint8_t *)p - allocHeaderSize);
+	if (pHeader->magic != allocMagic)
+		return __real_realloc(p, size);
+
+	//the grown block counts as a new allocation of the current scope
+	size_t oldSize = pHeader->size;
+	Untrack(p);
+	void *pNew = __real_realloc(pHeader, size + allocHeaderSize);
+	if (!pNew)
+	{
+		Track(pHeader, oldSize); //the old block is still valid
+		return NULL;
+	}
+	return Track(pNew, size);
+}
+
+#endif
+
+#endif
+
+const char *HomieAllocGetSiteName(eHomieAllocSite site)
+{
+	switch (site)
+	{
+	case homieAllocInit:
+		return "init";
+	case homieAllocTree:
+		return "tree";
+	case homieAllocInitialPublishing:
+		return "initial-publishing";
+	case homieAllocIncoming:
+		return "incoming";
+	case homieAllocPublish:
+		return "publish";
+	case homieAllocDispatch:
+		return "dispatch";
+	case homieAllocStats:
+		return "stats";
+	default:
+		return "";
+	}
+}
+
+const HomieAllocStats &HomieAllocGetStats(eHomieAllocSite site)
+{
+	return allocStats[site];
+}
+
+size_t HomieAllocGetMinLargestBlock()
+{
+	return minLargestBlock;
+}
+
+void HomieAllocReset()
+{
+	memset(allocStats, 0, sizeof(allocStats));
+	minLargestBlock = 0;
+}
+
+void HomieAllocReport()
+{
+#ifndef HOMIELIB_ALLOC_PROFILE
+	HOMIE_LOGI("Allocation profile not compiled in, build with HOMIELIB_ALLOC_PROFILE\n");
+#else
+	HOMIE_LOGI("%-20s %10s %10s %10s %10s %10s\n", "site", "calls", "allocs", "bytes", "retained", "peak");
+	for (int i = 0; i < homieAllocSiteCount; i++)
+	{
+		const HomieAllocStats &stats = allocStats[i];
+		HOMIE_LOGI("%-20s %10lu %10lu %10lu %10ld %10ld\n", HomieAllocGetSiteName((eHomieAllocSite)i), stats.calls, stats.allocations, stats.bytes, stats.retained, stats.peak);
+	}
+#ifndef HOMIELIB_ALLOC_HOST
+	HOMIE_LOGI("smallest largest free block %u\n", (unsigned int)minLargestBlock);
+#endif
+#endif
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "Arduino.h"
+
+//Attribution of the library's heap use to call sites, for tracking down fragmentation.
+//Build with HOMIELIB_ALLOC_PROFILE to enable, otherwise the scopes compile out and the API reads zeros.
+//On the host every operator new made inside a scope is counted and freed bytes are credited back to the site that
+//allocated them. Arduino String uses malloc/realloc/free instead; to count those too, also define
+//HOMIELIB_ALLOC_WRAP_MALLOC and link with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free.
+//On ESP8266/ESP32 only the heap before and after each scope is visible, so a site's bytes are its net heap growth
+//(nested scopes excluded), single allocations can't be counted, and other tasks allocating meanwhile show up too.
+//Scopes are tracked per thread, the counters themselves aren't atomic and can be off by a few under contention.
+
+enum eHomieAllocSite
+{
+	homieAllocInit,				 //HomieDevice::Init, node and property topics
+	homieAllocTree,				 //NewNode, NewProperty, AddCallback, AddStat
+	homieAllocInitialPublishing, //attributes and subscriptions after connect
+	homieAllocIncoming,			 //dispatch map entries
+	homieAllocPublish,			 //value publishes and heartbeats
+	homieAllocDispatch,			 //incoming messages, validation and callbacks
+	homieAllocStats,			 //$stats and the $state republish
+	homieAllocSiteCount,
+};
+
+struct HomieAllocStats
+{
+	unsigned long calls;	   //scopes entered
+	unsigned long allocations; //host only
+	unsigned long bytes;	   //allocated in total
+	long retained;			   //allocated and not yet freed
+	long peak;				   //highest retained
+};
+
+const char *HomieAllocGetSiteName(eHomieAllocSite site);
+const HomieAllocStats &HomieAllocGetStats(eHomieAllocSite site);
+size_t HomieAllocGetMinLargestBlock(); //smallest largest-free-block seen at scope exit, ESP only
+void HomieAllocReset();
+void HomieAllocReport(); //one log line per site at info level
+
+#ifdef HOMIELIB_ALLOC_PROFILE
+class HomieAllocScope
+{
+public:
+	HomieAllocScope(eHomieAllocSite site);
+	~HomieAllocScope();
+
+	eHomieAllocSite GetSite() { return site; }
+
+private:
+	eHomieAllocSite site;
+	HomieAllocScope *pOuter;
+	uint32_t freeHeap;
+	long innerGrowth = 0;
+};
+
+#define HOMIE_ALLOC_SCOPE(site) HomieAllocScope homieAllocScope(site)
+#else
+#define HOMIE_ALLOC_SCOPE(site)
+#endif
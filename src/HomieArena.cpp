@@ -0,0 +1,52 @@
+#include "HomieArena.h"
+
+HomieArena::~HomieArena()
+{
+	Release();
+}
+
+bool HomieArena::Reserve(size_t bytes)
+{
+	if (used)
+		return false;
+
+	if (bytes <= capacity)
+		return true;
+
+	Release();
+
+	pBlock = (uint8_t *)malloc(bytes);
+	if (!pBlock)
+		return false;
+
+	capacity = bytes;
+	return true;
+}
+
+void *HomieArena::Allocate(size_t size, size_t align)
+{
+	size_t start = (used + align - 1) & ~(align - 1);
+	if (!pBlock || start + size > capacity)
+		return NULL;
+
+	used = start + size;
+	return pBlock + start;
+}
+
+bool HomieArena::Owns(const void *p)
+{
+	return pBlock && (const uint8_t *)p >= pBlock && (const uint8_t *)p < pBlock + capacity;
+}
+
+void HomieArena::Reset()
+{
+	used = 0;
+}
+
+void HomieArena::Release()
+{
+	free(pBlock);
+	pBlock = NULL;
+	capacity = 0;
+	used = 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include "Arduino.h"
+#include <new>
+
+//Bump allocator over one heap block. Objects are never freed individually, Reset() releases everything at once
+//and keeps the block for reuse.
+class HomieArena
+{
+public:
+	~HomieArena();
+
+	bool Reserve(size_t bytes); //only while empty
+	void *Allocate(size_t size, size_t align);
+	bool Owns(const void *p);
+	void Reset();
+	void Release();
+
+	//Construct in the block, or on the heap once it is full
+	template <class T> T *New()
+	{
+		void *p = Allocate(sizeof(T), alignof(T));
+		return p ? new (p) T : new T;
+	}
+
+	template <class T> void Delete(T *p)
+	{
+		if (Owns(p))
+			p->~T();
+		else
+			delete p;
+	}
+
+	size_t GetUsed() { return used; }
+	size_t GetCapacity() { return capacity; }
+
+private:
+	uint8_t *pBlock = NULL;
+	size_t capacity = 0;
+	size_t used = 0;
+};
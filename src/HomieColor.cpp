@@ -0,0 +1,132 @@
+#include "HomieColor.h"
+#include "HomieNumeric.h"
+
+//percent to 0-255, rounded
+static const uint8_t percentTo8[101] = {
+	0, 3, 5, 8, 10, 13, 15, 18, 20, 23, 26, 28, 31, 33, 36, 38, 41, 43, 46, 48,
+	51, 54, 56, 59, 61, 64, 66, 69, 71, 74, 77, 79, 82, 84, 87, 89, 92, 94, 97, 99,
+	102, 105, 107, 110, 112, 115, 117, 120, 122, 125, 128, 130, 133, 135, 138, 140, 143, 145, 148, 150,
+	153, 156, 158, 161, 163, 166, 168, 171, 173, 176, 179, 181, 184, 186, 189, 191, 194, 196, 199, 201,
+	204, 207, 209, 212, 214, 217, 219, 222, 224, 227, 230, 232, 235, 237, 240, 242, 245, 247, 250, 252,
+	255};
+
+//x/255 rounded, for x in 0..65535
+static inline uint32_t Div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+uint32_t HomieHSVtoRGB(uint16_t h, uint8_t s, uint8_t v)
+{
+	if (s > 100)
+		s = 100;
+	if (v > 100)
+		v = 100;
+
+	uint32_t s8 = percentTo8[s];
+	uint32_t v8 = percentTo8[v];
+
+	//hue in sixths of the circle with 8 bits of fraction, 0..1535
+	uint32_t h6 = ((uint32_t)(h % 360) * 1536) / 360;
+	uint32_t sector = h6 >> 8;
+	uint32_t frac = h6 & 0xFF;
+
+	uint32_t p = Div255(v8 * (255 - s8));
+	uint32_t q = Div255(v8 * (255 - Div255(s8 * frac)));
+	uint32_t t = Div255(v8 * (255 - Div255(s8 * (255 - frac))));
+
+	uint32_t r, g, b;
+	switch (sector)
+	{
+	default:
+	case 0:
+		r = v8, g = t, b = p;
+		break;
+	case 1:
+		r = q, g = v8, b = p;
+		break;
+	case 2:
+		r = p, g = v8, b = t;
+		break;
+	case 3:
+		r = p, g = q, b = v8;
+		break;
+	case 4:
+		r = t, g = p, b = v8;
+		break;
+	case 5:
+		r = v8, g = p, b = q;
+		break;
+	}
+
+	return (r << 16) + (g << 8) + (b << 0);
+}
+
+void HomieHSVtoRGB(const HomieHSV *in, uint32_t *out, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		out[i] = HomieHSVtoRGB(in[i].h, in[i].s, in[i].v);
+	}
+}
+
+HomieHSV HomieRGBtoHSV(uint32_t rgb)
+{
+	int r = (rgb >> 16) & 0xFF;
+	int g = (rgb >> 8) & 0xFF;
+	int b = (rgb >> 0) & 0xFF;
+
+	int max = r > g ? (r > b ? r : b) : (g > b ? g : b);
+	int min = r < g ? (r < b ? r : b) : (g < b ? g : b);
+	int delta = max - min;
+
+	HomieHSV ret;
+	ret.v = (uint8_t)((max * 100 + 127) / 255);
+	ret.s = max ? (uint8_t)((delta * 100 + max / 2) / max) : 0;
+
+	int h = 0;
+	if (delta)
+	{
+		if (max == r)
+			h = (60 * (g - b) + delta / 2) / delta;
+		else if (max == g)
+			h = 120 + (60 * (b - r) + delta / 2) / delta;
+		else
+			h = 240 + (60 * (r - g) + delta / 2) / delta;
+
+		if (h < 0)
+			h += 360;
+	}
+	ret.h = (uint16_t)h;
+
+	return ret;
+}
+
+bool HomieParseRGB(const char *in, uint32_t &rgb)
+{
+	int32_t c[3];
+
+	if (HomieParseTriplet(in, strlen(in), c))
+	{
+		int r = c[0], g = c[1], b = c[2];
+		rgb = (r << 16) + (g << 8) + (b << 0);
+		return true;
+	}
+	return false;
+}
+
+bool HomieParseHSV(const char *in, uint32_t &rgb)
+{
+	int32_t c[3];
+
+	if (HomieParseTriplet(in, strlen(in), c))
+	{
+		if (c[0] < 0 || c[1] < 0 || c[2] < 0)
+			return false;
+
+		rgb = HomieHSVtoRGB((uint16_t)c[0], (uint8_t)(c[1] > 100 ? 100 : c[1]), (uint8_t)(c[2] > 100 ? 100 : c[2]));
+		return true;
+	}
+	return false;
+}
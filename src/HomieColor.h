@@ -0,0 +1,21 @@
+#pragma once
+#include "Arduino.h"
+
+//Integer color conversions, no FPU needed. Packed colors are 0x00RRGGBB.
+//HSV components are in homie units: hue 0-360, saturation and value 0-100.
+
+struct HomieHSV
+{
+	uint16_t h;
+	uint8_t s;
+	uint8_t v;
+};
+
+uint32_t HomieHSVtoRGB(uint16_t h, uint8_t s, uint8_t v);
+HomieHSV HomieRGBtoHSV(uint32_t rgb);
+
+//Bulk conversion for pixel buffers
+void HomieHSVtoRGB(const HomieHSV *in, uint32_t *out, size_t count);
+
+bool HomieParseRGB(const char *in, uint32_t &rgb);
+bool HomieParseHSV(const char *in, uint32_t &rgb);
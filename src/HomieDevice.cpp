@@ -1,62 +1,102 @@
 #include "HomieDevice.h"
 #include "HomieNode.h"
-void HomieLibDebugPrint(const char *szText);
-
-#define csprintf(...)                 \
-	{                                 \
-		char szTemp[256];             \
-		sprintf(szTemp, __VA_ARGS__); \
-		HomieLibDebugPrint(szTemp);   \
-	}
-
-static std::vector<HomieDebugPrintCallback> vecDebugPrint;
+#include "HomieNumeric.h"
+#include "HomieAlloc.h"
+#include <algorithm>
 
 const int ipub_qos = 1;
 const int sub_qos = 2;
+const int ipub_array_batch = 16; //$array values published per initial publishing step
 
-void HomieLibRegisterDebugPrintCallback(HomieDebugPrintCallback cb)
-{
-	vecDebugPrint.push_back(cb);
-}
+//Devices waiting to do initial publishing, in turn order. The front one is publishing.
+static std::vector<HomieDevice *> vecInitialPublishingQueue;
 
-void HomieLibDebugPrint(const char *szText)
+bool AllowInitialPublishing(HomieDevice *pSource)
 {
-	for (size_t i = 0; i < vecDebugPrint.size(); i++)
+	bool bQueued = false;
+	for (size_t i = 0; i < vecInitialPublishingQueue.size(); i++)
 	{
-		vecDebugPrint[i](szText);
+		if (vecInitialPublishingQueue[i] == pSource)
+		{
+			bQueued = true;
+			break;
+		}
 	}
-}
 
-HomieDevice *pToken = NULL;
+	if (!bQueued)
+	{
+		vecInitialPublishingQueue.push_back(pSource);
+		pSource->initialPublishingTurnUsed = 0;
+	}
 
-bool AllowInitialPublishing(HomieDevice *pSource)
+	//reclaim turns from devices that lost their connection mid-publish
+	while (vecInitialPublishingQueue.size() && !vecInitialPublishingQueue.front()->IsConnected())
+	{
+		vecInitialPublishingQueue.erase(vecInitialPublishingQueue.begin());
+	}
+
+	return vecInitialPublishingQueue.size() && vecInitialPublishingQueue.front() == pSource;
+}
+
+void ChargeInitialPublishing(HomieDevice *pSource, unsigned long messages)
 {
-	if (pToken == pSource)
-		return true;
-	if (!pToken)
+	if (!vecInitialPublishingQueue.size() || vecInitialPublishingQueue.front() != pSource)
+		return;
+
+	pSource->initialPublishingTurnUsed += messages;
+
+	int budget = pSource->iInitialPublishingBudget * pSource->iInitialPublishingWeight;
+	if (budget < 1)
+		budget = 1;
+
+	if (pSource->initialPublishingTurnUsed >= (unsigned long)budget && vecInitialPublishingQueue.size() > 1)
 	{
-		pToken = pSource;
-		return true;
+		//turn used up, go to the back of the line
+		vecInitialPublishingQueue.erase(vecInitialPublishingQueue.begin());
+		vecInitialPublishingQueue.push_back(pSource);
+		pSource->initialPublishingTurnUsed = 0;
 	}
-	return false;
 }
 
 void FinishInitialPublishing(HomieDevice *pSource)
 {
-	if (pToken == pSource)
+	for (size_t i = 0; i < vecInitialPublishingQueue.size(); i++)
 	{
-		pToken = NULL;
+		if (vecInitialPublishingQueue[i] == pSource)
+		{
+			vecInitialPublishingQueue.erase(vecInitialPublishingQueue.begin() + i);
+			break;
+		}
 	}
 }
 
-//#define HOMIELIB_VERBOSE
-
 HomieDevice::HomieDevice()
 {
 }
 
+HomieDevice::~HomieDevice()
+{
+	StopWorker();
+	Clear();
+
+	//virtual devices outliving their gateway are cut loose, they stay inert until SetGateway and Init again
+	for (size_t a = 0; a < vecVirtualDevice.size(); a++)
+	{
+		vecVirtualDevice[a]->DropFromLanes();
+		vecVirtualDevice[a]->pGateway = NULL;
+		vecVirtualDevice[a]->initialized = false;
+	}
+
+	if (pGateway)
+	{
+		std::vector<HomieDevice *> &vec = pGateway->vecVirtualDevice;
+		vec.erase(std::remove(vec.begin(), vec.end(), this), vec.end());
+	}
+}
+
 void HomieDevice::Init()
 {
+	HOMIE_ALLOC_SCOPE(homieAllocInit);
 
 	topic = String("homie/") + id;
 	strcpy(szWillTopic, String(topic + "/$state").c_str());
@@ -83,79 +123,189 @@ void HomieDevice::Init()
 		node[a]->Init();
 	}
 
-	if (this->useIp)
+	index.Build(node);
+
+	if (bStaticMemory)
 	{
-		mqtt.setServer(this->mqttServerIp, this->mqttServerPort);
+		//a property waits in at most one lane at a time, and the lanes hold everything on the connection
+		HomieDevice &owner = Owner();
+		size_t properties = 0;
+		for (size_t d = 0; d <= owner.vecVirtualDevice.size(); d++)
+		{
+			HomieDevice *pDevice = d ? owner.vecVirtualDevice[d - 1] : &owner;
+			for (size_t a = 0; a < pDevice->node.size(); a++)
+			{
+				properties += pDevice->node[a]->vecProperty.size();
+			}
+		}
+		for (int lane = 0; lane < homieLaneMeta; lane++)
+		{
+			owner.vecLane[lane].reserve(properties);
+		}
 	}
-	else
+
+	AddBuiltinStats();
+
+	for (size_t i = 0; i < vecStat.size(); i++)
 	{
-		mqtt.setServer(this->mqttServerHost, this->mqttServerPort);
+		vecStat[i].topic = topic + "/$stats/" + vecStat[i].id;
 	}
 
-	if (this->mqttUsername != NULL && this->mqttPassword != NULL)
+	if (bStaticMemory)
 	{
-		mqtt.setCredentials(this->mqttUsername, this->mqttPassword);
+		ReserveInitialPublishingList();
 	}
 
-	mqtt.setWill(szWillTopic, 2, true, "lost");
+	sendError = false;
 
-	mqtt.onConnect(std::bind(&HomieDevice::onConnect, this, std::placeholders::_1));
-	mqtt.onDisconnect(std::bind(&HomieDevice::onDisconnect, this, std::placeholders::_1));
-	mqtt.onMessage(std::bind(&HomieDevice::onMqttMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6));
+	if (pGateway)
+	{
+		//the gateway owns server, will and callbacks
+		initialized = true;
+		return;
+	}
 
-	sendError = false;
+	ApplyBroker();
+
+	mqtt.setWill(szWillTopic, 2, true, "lost");
+
+	if (!callbacksRegistered)
+	{
+		//AsyncMqttClient appends handlers, so only once even if Init runs again after Clear
+		mqtt.onConnect(std::bind(&HomieDevice::onConnect, this, std::placeholders::_1));
+		mqtt.onDisconnect(std::bind(&HomieDevice::onDisconnect, this, std::placeholders::_1));
+		mqtt.onPublish(std::bind(&HomieDevice::onPublish, this, std::placeholders::_1));
+		mqtt.onMessage(std::bind(&HomieDevice::onMqttMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6));
+		callbacksRegistered = true;
+	}
 
 	initialized = true;
 }
 
 void HomieDevice::Quit()
 {
-	Publish(String(topic + "/$state").c_str(), 1, true, "disconnected");
-	mqtt.disconnect(false);
+	for (size_t a = 0; a < vecVirtualDevice.size(); a++)
+	{
+		vecVirtualDevice[a]->Quit();
+	}
+
+	Publish(szWillTopic, 1, true, "disconnected");
 	initialized = false;
+	if (!pGateway)
+	{
+		FinishInitialPublishing(this);
+		mqtt.disconnect(false);
+	}
+	else if (!IsConnectionPublishing())
+	{
+		FinishInitialPublishing(pGateway); //we were the last one on the connection still publishing
+	}
 }
 
 bool HomieDevice::IsConnected()
 {
-	return mqtt.connected();
+	return Mqtt().connected();
+}
+
+void HomieDevice::SetGateway(HomieDevice *pGatewayIn)
+{
+	if (initialized || pGateway || !pGatewayIn || pGatewayIn == this)
+		return;
+
+	pGateway = pGatewayIn;
+	pGateway->vecVirtualDevice.push_back(this);
 }
 
-int iWiFiRSSI = 0;
+AsyncMqttClient &HomieDevice::Mqtt()
+{
+	return pGateway ? pGateway->mqtt : mqtt;
+}
+
+_map_incoming &HomieDevice::Incoming()
+{
+	return pGateway ? pGateway->incoming : incoming;
+}
 
 void HomieDevice::Loop()
 {
 	if (!initialized)
 		return;
 
+	if (workerRunning && !IsWorkerThread())
+		return; //the worker owns the loop
+
+#ifdef HOMIELIB_METRICS
+	unsigned long loopStart = micros();
+	DoLoop();
+	metrics.Record(homieHistogramLoop_us, micros() - loopStart);
+#else
+	DoLoop();
+#endif
+}
+
+void HomieDevice::DoLoop()
+{
+	ApplyQueuedValues();
+
+	if (!pGateway && mqtt.connected())
+	{
+		FlushLanes(); //every loop, so urgent publishes don't wait for the next tick
+	}
+
 	bool bEvenSecond = false;
+	bool bEvenDeciSecond = false;
+
+	if (pGateway)
+	{
+		//virtual devices run on their gateway's clock, so they all see the tick its step budget is handed out in
+		bEvenSecond = pGateway->gatewaySecondTick;
+		bEvenDeciSecond = pGateway->gatewayDeciSecondTick;
+	}
+	else
+	{
+		if ((int)(millis() - lastLoopSecondCounterTimestamp) >= 1000)
+		{
+			lastLoopSecondCounterTimestamp += 1000;
+			bEvenSecond = true;
+		}
+
+		if ((int)(millis() - lastLoopDeciSecondCounterTimestamp) >= 100)
+		{
+			lastLoopDeciSecondCounterTimestamp += 100;
+			bEvenDeciSecond = true;
+		}
+	}
 
-	if ((int)(millis() - lastLoopSecondCounterTimestamp) >= 1000)
+	if (bEvenSecond)
 	{
-		lastLoopSecondCounterTimestamp += 1000;
 		secondCounter_Uptime++;
 		secondCounter_WiFi++;
 		secondCounter_MQTT++;
+	}
 
-		if (bRapidUpdateRSSI && (secondCounter_Uptime & 1))
+	if (vecVirtualDevice.size())
+	{
+		gatewaySecondTick = bEvenSecond;
+		gatewayDeciSecondTick = bEvenDeciSecond;
+		if (bEvenDeciSecond)
 		{
-			int iWiFiRSSI_Current = WiFi.RSSI();
-			if (iWiFiRSSI != iWiFiRSSI_Current)
-			{
-				iWiFiRSSI = iWiFiRSSI_Current;
+			gatewayStepsLeft = iGatewayStepsPerTick;
+		}
 
-				Publish(String(topic + "/$stats/signal").c_str(), 2, true, String(iWiFiRSSI).c_str());
+		//round-robin, the next tick's steps start behind the last virtual device that took one
+		size_t count = vecVirtualDevice.size();
+		size_t next = gatewayLoopOffset;
+		for (size_t a = 0; a < count; a++)
+		{
+			size_t i = (a + gatewayLoopOffset) % count;
+			int stepsBefore = gatewayStepsLeft;
+			vecVirtualDevice[i]->Loop();
+			if (gatewayStepsLeft != stepsBefore)
+			{
+				next = (i + 1) % count;
 			}
 		}
-
-		bEvenSecond = true;
-	}
-
-	bool bEvenDeciSecond = false;
-
-	if ((int)(millis() - lastLoopDeciSecondCounterTimestamp) >= 100)
-	{
-		lastLoopDeciSecondCounterTimestamp += 100;
-		bEvenDeciSecond = true;
+		gatewayLoopOffset = next;
 	}
 
 	if (!bEvenDeciSecond)
@@ -172,38 +322,54 @@ void HomieDevice::Loop()
 		return;
 	}
 
-	if (mqtt.connected())
+	if (Mqtt().connected())
 	{
+		if (!pGateway && health.CheckStall())
+		{
+			mqtt.disconnect(true);
+			connecting = false;
+			return;
+		}
 
-		DoInitialPublishing();
+		PublishStats();
 
-		//		pubsubClient.loop();
-		mqttReconnectCount = 0;
+		if (!pGateway && initialPublishingDone)
+		{
+			CheckFailback();
+		}
 
-		if ((int)(millis() - homieStatsTimestamp) >= 30000)
+		if (!pGateway && topicAliases.bEnabled && topicAliases.IsRebalanceDue())
 		{
-			bool bError = false;
+			RebalanceTopicAliases();
+		}
 
-			if (initialPublishingDone)
-			{
-				bError |= 0 == Publish(String(topic + "/$state").c_str(), ipub_qos, true, "ready"); //re-publish ready every time we update stats
-			}
+		if (!IsLaneBusy(homieLaneMeta))
+		{
+			DoInitialPublishing();
+		}
 
-			bError |= 0 == Publish(String(topic + "/$stats/uptime").c_str(), 2, true, String(secondCounter_Uptime).c_str());
-			bError |= 0 == Publish(String(topic + "/$stats/uptime-wifi").c_str(), 2, true, String(secondCounter_WiFi).c_str());
-			bError |= 0 == Publish(String(topic + "/$stats/uptime-mqtt").c_str(), 2, true, String(secondCounter_MQTT).c_str());
-			bError |= 0 == Publish(String(topic + "/$stats/signal").c_str(), 2, true, String(WiFi.RSSI()).c_str());
+		//		pubsubClient.loop();
 
-			if (bError)
+		if (initialPublishingDone && (int)(millis() - homieStatsTimestamp) >= (int)statsInterval_ms)
+		{
+			HOMIE_ALLOC_SCOPE(homieAllocStats);
+			if (0 == Publish(szWillTopic, ipub_qos, true, "ready")) //re-publish ready every stats interval
 			{
-				homieStatsTimestamp = millis() - (30000 - GetErrorRetryFrequency()); //retry in a while
+				homieStatsTimestamp = millis() - (statsInterval_ms - GetErrorRetryFrequency()); //retry in a while
 			}
 			else
 			{
 				homieStatsTimestamp = millis();
 			}
+		}
 
-			//			csprintf("Periodic publishing: %i, %i, %i\n",pub_return[0],pub_return[1],pub_return[2]);
+		if (bEvenSecond && initialPublishingDone)
+		{
+			HOMIE_ALLOC_SCOPE(homieAllocPublish);
+			for (size_t a = 0; a < node.size(); a++)
+			{
+				node[a]->PublishHeartbeats();
+			}
 		}
 
 		if (doPublishDefaults && (int)(millis() - publishDefaultsTimestamp) > 0)
@@ -219,26 +385,29 @@ void HomieDevice::Loop()
 	else
 	{
 
-		//csprintf("not connected. bConnecting=%i\n",bConnecting);
-
 		secondCounter_MQTT = 0;
 
 		homieStatsTimestamp = millis() - 1000000;
 
-		if (!connecting)
+		if (pGateway)
+		{
+			//the gateway reconnects for us
+		}
+		else if (!connecting)
 		{
-
-			//csprintf("millis()-ulLastReconnect=%i  interval=%i\n",millis()-ulLastReconnect,interval);
-
 			if (!lastReconnect || (millis() - lastReconnect) > GetReconnectInterval())
 			{
 
-				csprintf("Connecting to MQTT server %s...\n", strMqttServerIP.c_str());
+				ApplyBroker();
+
+				const HomieBroker *pBroker = GetBroker(currentBroker);
+				HOMIE_LOGI("Connecting to MQTT server %s...\n", !pBroker ? "(none)" : pBroker->useIp ? pBroker->ip.toString().c_str() : pBroker->host);
 				connecting = true;
 				sendError = false;
 				initialPublishingDone = false;
 
 				connectTimestamp = millis();
+				health.OnConnecting();
 				mqtt.connect();
 			}
 		}
@@ -247,7 +416,7 @@ void HomieDevice::Loop()
 			//if we're still not connected after a minute, try again
 			if (!connectTimestamp || (millis() - connectTimestamp) > 60000)
 			{
-				csprintf("Reconnect needed, dangling flag\n");
+				HOMIE_LOGW("Reconnect needed, dangling flag\n");
 				mqtt.disconnect(true);
 				connecting = false;
 			}
@@ -260,18 +429,55 @@ void HomieDevice::onConnect(bool sessionPresent)
 	if (sessionPresent) //squelch unused parameter warning
 	{
 	}
-#ifdef HOMIELIB_VERBOSE
-	csprintf("onConnect... %p\n", this);
-#endif
+	HOMIE_LOGD("onConnect... %p\n", this);
 	connecting = false;
 
+	if (!pGateway)
+	{
+		health.OnConnected();
+
+		if (currentBroker < vecBroker.size())
+		{
+			HomieBroker &broker = vecBroker[currentBroker];
+			unsigned long latency = millis() - connectTimestamp;
+			broker.connectLatency_ms = broker.connects ? (3 * broker.connectLatency_ms + latency) / 4 : latency;
+			broker.connects++;
+			broker.failures = 0;
+		}
+
+		topicAliases.OnConnected(0); //no Topic Alias Maximum in a 3.1.1 CONNACK
+
+		brokerChanged = sessionBroker != (size_t)-1 && sessionBroker != currentBroker;
+		sessionBroker = currentBroker;
+		failbackTimestamp = millis();
+	}
+
 	doInitialPublishing = true;
+	initialPublishingDone = false;
 	initialPublishing = 0;
 	initialPublishing_Node = 0;
 	initialPublishing_Prop = 0;
+	initialPublishing_Index = 0;
 	pubCount_Props = 0;
 
+	initialPublishingStart = millis();
+	initialPublishingWaitStart = 0;
+	initialPublishingWaitTotal = 0;
+	initialPublishingWaitMax = 0;
+
 	secondCounter_MQTT = 0;
+
+	for (size_t i = 0; i < vecStat.size(); i++)
+	{
+		vecStat[i].published = false; //new session, publish everything once
+	}
+
+	HOMIE_METRIC_INC(metrics, homieCounterReconnect);
+
+	for (size_t a = 0; a < vecVirtualDevice.size(); a++)
+	{
+		vecVirtualDevice[a]->onConnect(sessionPresent);
+	}
 }
 
 void HomieDevice::onDisconnect(AsyncMqttClientDisconnectReason reason)
@@ -279,91 +485,530 @@ void HomieDevice::onDisconnect(AsyncMqttClientDisconnectReason reason)
 	if (reason == AsyncMqttClientDisconnectReason::TCP_DISCONNECTED)
 	{
 	}
-	//csprintf("onDisconnect...");
+
+	FinishInitialPublishing(this); //give up our turn, we'll queue again after reconnecting
+	lastReconnect = millis();
+	SelectBroker(connecting);
 	if (connecting)
 	{
-		lastReconnect = millis();
-		mqttReconnectCount++;
 		connecting = false;
-		//csprintf("onDisconnect...   reason %i.. lr=%lu\n",reason,ulLastReconnect);
-		csprintf("MQTT server connection failed. Retrying in %lums\n", GetReconnectInterval());
+		HOMIE_LOGW("MQTT server connection failed. Retrying in %lums\n", GetReconnectInterval());
 	}
 	else
 	{
-		csprintf("MQTT server connection lost\n");
+		HOMIE_LOGW("MQTT server connection lost. Reconnecting in %lums\n", GetReconnectInterval());
+	}
+}
+
+void HomieDevice::RebalanceTopicAliases()
+{
+	//array slots have a topic per index and standard MQTT topics are few, neither gets an alias.
+	//The vector keeps its capacity, only the first rebalance grows it.
+	vecAliasCandidate.clear();
+	for (size_t d = 0; d <= vecVirtualDevice.size(); d++)
+	{
+		HomieDevice *pDevice = d ? vecVirtualDevice[d - 1] : this;
+		for (size_t a = 0; a < pDevice->node.size(); a++)
+		{
+			HomieNode *pNode = pDevice->node[a];
+			if (pNode->IsArray())
+				continue;
+			for (size_t b = 0; b < pNode->vecProperty.size(); b++)
+			{
+				if (!pNode->vecProperty[b]->standardMQTT)
+				{
+					vecAliasCandidate.push_back(pNode->vecProperty[b]);
+				}
+			}
+		}
 	}
+
+	topicAliases.Rebalance(vecAliasCandidate);
+}
+
+void HomieDevice::onPublish(uint16_t packetId)
+{
+	health.OnPublishAcked(packetId);
 }
 
 void HomieDevice::onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
 {
-	String strTopic = topic;
-	_map_incoming::const_iterator citer = incoming.find(strTopic);
+	HOMIE_ALLOC_SCOPE(homieAllocDispatch);
+
+	if (index != 0)
+		return; //properties only handle the first chunk
 
-	if (citer != incoming.end())
+	//homie property topics resolve through the index without building a String key
+	bool bDispatched = DispatchProperty(topic, payload, properties, len, total);
+	for (size_t a = 0; a < vecVirtualDevice.size() && !bDispatched; a++)
 	{
-		HomieProperty *pProp = citer->second;
-		if (pProp)
+		bDispatched = vecVirtualDevice[a]->DispatchProperty(topic, payload, properties, len, total);
+	}
+
+	if (bDispatched)
+		return;
+
+	//standard MQTT topics, they are few and a scan doesn't need a String key
+	HomieProperty *pStandard = NULL;
+	_map_incoming &map = Incoming();
+	for (_map_incoming::const_iterator citer = map.begin(); citer != map.end(); citer++)
+	{
+		if (citer->first == topic)
 		{
+			pStandard = citer->second;
+			break;
+		}
+	}
 
-			pProp->OnMqttMessage(topic, payload, properties, len, index, total);
+	if (pStandard)
+	{
+		pStandard->OnMqttMessage(topic, payload, properties, len, index, total);
+	}
+	else if (OwnsTopic(topic))
+	{
+		HOMIE_METRIC_INC(metrics, homieCounterDispatchMiss); //other devices' topics may be someone else's, e.g. HomieDiscovery
+	}
+}
+
+bool HomieDevice::OwnsTopic(const char *szTopic)
+{
+	if (!strncmp(szTopic, topic.c_str(), topic.length()) && szTopic[topic.length()] == '/')
+		return true;
+
+	for (size_t a = 0; a < vecVirtualDevice.size(); a++)
+	{
+		if (vecVirtualDevice[a]->OwnsTopic(szTopic))
+			return true;
+	}
+	return false;
+}
+
+bool HomieDevice::DispatchProperty(char *szTopic, char *payload, AsyncMqttClientMessageProperties &properties, size_t len, size_t total)
+{
+	//homie/<device>/<node>/<property>/set or homie/<device>/<node>_<index>/<property>/set, and the base topic
+	//homie/<device>/<node>/<property> while a retained value is being restored
+	size_t deviceLen = topic.length();
+	if (strncmp(szTopic, topic.c_str(), deviceLen) || szTopic[deviceLen] != '/')
+		return false;
+
+	const char *szNode = szTopic + deviceLen + 1;
+	const char *szNodeEnd = strchr(szNode, '/');
+	if (!szNodeEnd)
+		return false;
+
+	const char *szProp = szNodeEnd + 1;
+	const char *szPropEnd = strchr(szProp, '/');
+	if (!szPropEnd)
+	{
+		HomieProperty *pProp = FindProperty(szNode, szNodeEnd - szNode, szProp, strlen(szProp));
+		if (!pProp || !pProp->settable || pProp->parent->IsArray() || pProp->standardMQTT)
+			return false;
+
+		//only the restore of a retained value, anything else on the base topic is our own publish coming back
+		if (pProp->retained && !pProp->receivedRetained)
+		{
+			pProp->OnMqttMessage(szTopic, payload, properties, len, 0, total);
 		}
+		return true;
 	}
+	if (strcmp(szPropEnd, "/set"))
+		return false;
 
-	//csprintf("RECEIVED %s %s\n",topic,payload);
+	HomieProperty *pProp = FindProperty(szNode, szNodeEnd - szNode, szProp, szPropEnd - szProp);
+	if (pProp && pProp->settable && !pProp->parent->IsArray() && !pProp->standardMQTT)
+	{
+		pProp->OnMqttMessage(szTopic, payload, properties, len, 0, total);
+		return true;
+	}
+
+	const char *szUnderscore = szNodeEnd;
+	while (szUnderscore > szNode && *szUnderscore != '_')
+		szUnderscore--;
+	if (szUnderscore == szNode)
+		return false;
+
+	int32_t index;
+	if (!HomieParseInt(szUnderscore + 1, szNodeEnd - szUnderscore - 1, index) || index < 0)
+		return false;
+
+	pProp = FindProperty(szNode, szUnderscore - szNode, szProp, szPropEnd - szProp);
+	if (!pProp || !pProp->settable || !pProp->parent->IsArray() || index >= pProp->parent->arraySize)
+		return false;
+
+	pProp->OnArrayMessage((uint16_t)index, payload, len);
+	return true;
+}
+
+HomieIndex &HomieDevice::Index()
+{
+	if (!index.IsBuilt())
+	{
+		index.Build(node);
+	}
+	return index;
+}
+
+HomieNode *HomieDevice::FindNode(const char *id)
+{
+	return Index().FindNode(id, strlen(id));
+}
+
+HomieProperty *HomieDevice::FindProperty(const char *path)
+{
+	return Index().FindProperty(path, strlen(path));
+}
+
+HomieProperty *HomieDevice::FindProperty(const char *nodeId, size_t nodeLen, const char *propId, size_t propLen)
+{
+	return Index().FindProperty(nodeId, nodeLen, propId, propLen);
 }
 
 HomieNode *HomieDevice::NewNode()
 {
-	HomieNode *ret = new HomieNode;
+	HOMIE_ALLOC_SCOPE(homieAllocTree);
+	HomieNode *ret = arena.New<HomieNode>();
 	node.push_back(ret);
 	ret->parent = this;
+	index.Invalidate();
 
 	return ret;
 }
 
+void HomieDevice::Reserve(size_t nodes, size_t properties)
+{
+	size_t bytes = nodes * (sizeof(HomieNode) + alignof(HomieNode)) + properties * (sizeof(HomieProperty) + alignof(HomieProperty));
+
+	if (!arena.Reserve(bytes))
+	{
+		HOMIE_LOGW("Reserve for %i nodes, %i properties failed\n", (int)nodes, (int)properties);
+		return;
+	}
+
+	node.reserve(nodes);
+}
+
+void HomieDevice::Clear()
+{
+	if (initialized)
+		Quit();
+
+	//the dispatch map may be the gateway's, only drop our own entries
+	_map_incoming &map = Incoming();
+	for (_map_incoming::iterator it = map.begin(); it != map.end();)
+	{
+		if (it->second->parent->parent == this)
+		{
+			if (IsConnected())
+				Mqtt().unsubscribe(it->first.c_str());
+			it = map.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	DropFromLanes();
+
+	for (size_t a = 0; a < node.size(); a++)
+	{
+		for (size_t b = 0; b < node[a]->vecProperty.size(); b++)
+		{
+			arena.Delete(node[a]->vecProperty[b]);
+		}
+		arena.Delete(node[a]);
+	}
+
+	pendingHead = NULL;
+	node.clear();
+	index.Invalidate();
+	arena.Reset();
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void HomieDevice::WorkerTask(void *pParam)
+{
+	HomieDevice *pDevice = (HomieDevice *)pParam;
+	pDevice->workerTask = xTaskGetCurrentTaskHandle();
+	while (pDevice->workerRunning)
+	{
+		pDevice->Loop();
+		vTaskDelay(pdMS_TO_TICKS(pDevice->workerInterval_ms));
+	}
+	pDevice->workerTask = NULL;
+	pDevice->workerAlive = false;
+	vTaskDelete(NULL);
+}
+#endif
+
+bool HomieDevice::StartWorker(unsigned long interval_ms, uint32_t stackSize, int priority, int core)
+{
+	if (workerRunning || pGateway || !initialized)
+		return false;
+
+	workerInterval_ms = interval_ms ? interval_ms : 1;
+
+	//value slots for the hand-off, the only allocation worker mode needs
+	for (size_t d = 0; d <= vecVirtualDevice.size(); d++)
+	{
+		HomieDevice *pDevice = d ? vecVirtualDevice[d - 1] : this;
+		for (size_t a = 0; a < pDevice->node.size(); a++)
+		{
+			for (size_t b = 0; b < pDevice->node[a]->vecProperty.size(); b++)
+			{
+				pDevice->node[a]->vecProperty[b]->ReservePending();
+			}
+		}
+	}
+
+	workerRunning = true;
+
+#if defined(ARDUINO_ARCH_ESP32)
+	workerAlive = true;
+	if (xTaskCreatePinnedToCore(WorkerTask, "homie", stackSize, this, priority, NULL, core) != pdPASS)
+	{
+		workerAlive = false;
+		workerRunning = false;
+		HOMIE_LOGE("Worker task creation failed\n");
+		return false;
+	}
+	return true;
+#elif !defined(ARDUINO_ARCH_ESP8266)
+	if (stackSize || priority || core) //squelch unused parameter warnings, the host thread uses the defaults
+	{
+	}
+	workerThread = std::thread([this]() {
+		workerThreadId = std::this_thread::get_id();
+		while (workerRunning)
+		{
+			Loop();
+			std::this_thread::sleep_for(std::chrono::milliseconds(workerInterval_ms));
+		}
+	});
+	return true;
+#else
+	if (stackSize || priority || core)
+	{
+	}
+	workerRunning = false;
+	HOMIE_LOGW("Worker mode needs an ESP32 or a host build\n");
+	return false;
+#endif
+}
+
+void HomieDevice::StopWorker()
+{
+	if (!workerRunning)
+		return;
+
+	workerRunning = false;
+
+#if defined(ARDUINO_ARCH_ESP32)
+	while (workerAlive)
+	{
+		vTaskDelay(1);
+	}
+#elif !defined(ARDUINO_ARCH_ESP8266)
+	if (workerThread.joinable())
+		workerThread.join();
+	workerThreadId = std::thread::id();
+#endif
+}
+
+bool HomieDevice::IsWorkerThread()
+{
+#if defined(ARDUINO_ARCH_ESP32)
+	return xTaskGetCurrentTaskHandle() == workerTask;
+#elif !defined(ARDUINO_ARCH_ESP8266)
+	return std::this_thread::get_id() == workerThreadId.load();
+#else
+	return true;
+#endif
+}
+
+bool HomieDevice::IsLaneBusy(eHomiePublishLane lane)
+{
+	HomieDevice &owner = Owner();
+	for (int a = 0; a <= lane && a < homieLaneMeta; a++)
+	{
+		if (owner.vecLane[a].size())
+			return true;
+	}
+	return false;
+}
+
+void HomieDevice::QueuePublish(HomieProperty *pProp)
+{
+	if (pProp->lanePending)
+		return; //already waiting, it will take the latest value
+
+	eHomiePublishLane lane = pProp->lane < homieLaneMeta ? pProp->lane : homieLaneStats;
+	pProp->lanePending = true;
+	Owner().vecLane[lane].push_back(pProp);
+	HOMIE_METRIC_INC(metrics, homieCounterPublishDeferred);
+}
+
+void HomieDevice::DropFromLanes()
+{
+	HomieDevice &owner = Owner();
+	for (int lane = 0; lane < homieLaneMeta; lane++)
+	{
+		std::vector<HomieProperty *> &vec = owner.vecLane[lane];
+		size_t kept = 0;
+		for (size_t i = 0; i < vec.size(); i++)
+		{
+			if (vec[i]->parent->parent == this)
+				vec[i]->lanePending = false;
+			else
+				vec[kept++] = vec[i];
+		}
+		vec.resize(kept);
+	}
+}
+
+bool HomieDevice::FlushLanes()
+{
+	for (int lane = 0; lane < homieLaneMeta; lane++)
+	{
+		std::vector<HomieProperty *> &vec = vecLane[lane];
+
+		size_t sent = 0;
+		while (sent < vec.size() && vec[sent]->PublishValue())
+		{
+			vec[sent]->lanePending = false;
+			sent++;
+		}
+		vec.erase(vec.begin(), vec.begin() + sent);
+
+		if (vec.size())
+			return false; //client buffer full, less urgent lanes wait
+	}
+	return true;
+}
+
+bool HomieDevice::ShouldQueueValues()
+{
+	HomieDevice &owner = pGateway ? *pGateway : *this;
+	return owner.workerRunning && !owner.IsWorkerThread();
+}
+
+void HomieDevice::QueueProperty(HomieProperty *pProp)
+{
+	//Treiber stack push. The worker takes the whole stack at once, so there's no pop to race and no ABA.
+	HomieProperty *pHead = pendingHead.load(std::memory_order_relaxed);
+	do
+	{
+		pProp->pendingNext = pHead;
+	} while (!pendingHead.compare_exchange_weak(pHead, pProp, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void HomieDevice::ApplyQueuedValues()
+{
+	HomieProperty *pList = pendingHead.exchange(NULL, std::memory_order_acquire);
+
+	//reverse to the order the properties were first queued in. Producers don't touch pendingNext while a
+	//property is queued, so it's read before each property is released in ApplyQueuedValue.
+	HomieProperty *pOrdered = NULL;
+	while (pList)
+	{
+		HomieProperty *pNext = pList->pendingNext;
+		pList->pendingNext = pOrdered;
+		pOrdered = pList;
+		pList = pNext;
+	}
+
+	while (pOrdered)
+	{
+		HomieProperty *pNext = pOrdered->pendingNext;
+		pOrdered->ApplyQueuedValue();
+		pOrdered = pNext;
+	}
+}
+
 void HomieDevice::HandleInitialPublishingError()
 {
-	csprintf("Initial publishing error at stage %i, retrying in %i\n", initialPublishing, GetErrorRetryFrequency());
+	HOMIE_LOGW("Initial publishing error at stage %i, retrying in %i\n", initialPublishing, GetErrorRetryFrequency());
 
-	initialPublishing = millis() + GetErrorRetryFrequency();
+	initialPublishingTimestamp = millis() + GetErrorRetryFrequency();
 }
 
 void HomieDevice::DoInitialPublishing()
 {
+	HOMIE_ALLOC_SCOPE(homieAllocInitialPublishing);
+
 	if (!doInitialPublishing)
 	{
 		initialPublishing = 0;
-		initialPublishing = 0;
+		initialPublishingTimestamp = 0;
 		return;
 	}
 
-	if (initialPublishing != 0 && (int)(millis() - initialPublishing) < iInitialPublishingThrottle_ms)
+	int throttle_ms = (pGateway ? pGateway : this)->brokerChanged ? iFailoverPublishingThrottle_ms : iInitialPublishingThrottle_ms;
+	if (initialPublishingTimestamp != 0 && (int)(millis() - initialPublishingTimestamp) < throttle_ms)
 	{
 		return;
 	}
 
-	if (!initialPublishing)
+	if (pGateway && pGateway->gatewayStepsLeft <= 0)
 	{
-		csprintf("%s MQTT Initial Publishing...\n", topic.c_str());
+		return; //the other virtual devices used up this tick's steps
+	}
+
+	if (!initialPublishingTimestamp)
+	{
+		HOMIE_LOGI("%s MQTT Initial Publishing...\n", topic.c_str());
 		pubCount_Props = 0;
 	}
 
-	initialPublishing = millis();
+	initialPublishingTimestamp = millis();
 
-	if (!AllowInitialPublishing(this))
+	//a gateway and its virtual devices share one connection, so they take turns together
+	HomieDevice *pTurn = pGateway ? pGateway : this;
+
+	if (!AllowInitialPublishing(pTurn))
+	{
+		if (!initialPublishingWaitStart)
+			initialPublishingWaitStart = millis();
 		return;
+	}
 
-#ifdef HOMIELIB_VERBOSE
-	if (debug)
-		csprintf("IPUB: %i        Node=%i  Prop=%i\n", initialPublishing, initialPublishing_Node, initialPublishing_Prop);
-#endif
+	//the turn is the connection's, but each device on it counts its own wait
+	if (initialPublishingWaitStart)
+	{
+		unsigned long wait = millis() - initialPublishingWaitStart;
+		initialPublishingWaitTotal += wait;
+		if (wait > initialPublishingWaitMax)
+			initialPublishingWaitMax = wait;
+		initialPublishingWaitStart = 0;
+	}
+
+	if (pGateway)
+	{
+		pGateway->gatewayStepsLeft--;
+	}
+
+	unsigned long messagesBefore = initialPublishingMessages;
+
+	DoInitialPublishingStep();
+
+	ChargeInitialPublishing(pTurn, initialPublishingMessages - messagesBefore);
+}
+
+void HomieDevice::DoInitialPublishingStep()
+{
+
+	HOMIE_LOGD("IPUB: %i        Node=%i  Prop=%i\n", initialPublishing, initialPublishing_Node, initialPublishing_Prop);
+
+	//topics and payloads go through fixed buffers and initialPublishingList, a reconnect allocates nothing
+	char szTopic[HOMIELIB_TOPIC_BUFFER];
+	char szValue[24];
 
 	if (initialPublishing == 0)
 	{
 		bool bError = false;
-		bError |= 0 == Publish(String(topic + "/$state").c_str(), ipub_qos, true, "init");
-		bError |= 0 == Publish(String(topic + "/$homie").c_str(), ipub_qos, true, "3.0.1");
-		bError |= 0 == Publish(String(topic + "/$name").c_str(), ipub_qos, true, friendlyName.c_str());
+		bError |= 0 == Publish(szWillTopic, ipub_qos, true, "init");
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$homie"), ipub_qos, true, "3.0.1");
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$name"), ipub_qos, true, friendlyName.c_str());
 		if (bError)
 		{
 			HandleInitialPublishingError();
@@ -378,9 +1023,16 @@ void HomieDevice::DoInitialPublishing()
 	if (initialPublishing == 1)
 	{
 		bool bError = false;
-		bError |= 0 == Publish(String(topic + "/$localip").c_str(), ipub_qos, true, WiFi.localIP().toString().c_str());
-		bError |= 0 == Publish(String(topic + "/$mac").c_str(), ipub_qos, true, WiFi.macAddress().c_str());
-		bError |= 0 == Publish(String(topic + "/$extensions").c_str(), ipub_qos, true, "");
+		IPAddress ip = WiFi.localIP();
+		snprintf(szValue, sizeof(szValue), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$localip"), ipub_qos, true, szValue);
+
+		uint8_t mac[6];
+		WiFi.macAddress(mac);
+		snprintf(szValue, sizeof(szValue), "%02X:%02X:%02X:%02X:%02X:%02X", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$mac"), ipub_qos, true, szValue);
+
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$extensions"), ipub_qos, true, "");
 
 		if (bError)
 		{
@@ -397,23 +1049,29 @@ void HomieDevice::DoInitialPublishing()
 	{
 		bool bError = false;
 
-		bError |= 0 == Publish(String(topic + "/$stats").c_str(), ipub_qos, true, "uptime,signal,uptime-wifi,uptime-mqtt");
-		bError |= 0 == Publish(String(topic + "/$stats/interval").c_str(), ipub_qos, true, "60");
+		initialPublishingList = "";
+		for (size_t i = 0; i < vecStat.size(); i++)
+		{
+			if (i)
+				initialPublishingList += ',';
+			initialPublishingList += vecStat[i].id;
+		}
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$stats"), ipub_qos, true, initialPublishingList.c_str());
+
+		snprintf(szValue, sizeof(szValue), "%lu", statsInterval_ms / 1000);
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$stats/interval"), ipub_qos, true, szValue);
 
-		String strNodes;
+		initialPublishingList = "";
 		for (size_t i = 0; i < node.size(); i++)
 		{
-			strNodes += node[i]->id;
-			if (i < node.size() - 1)
-				strNodes += ",";
+			if (i)
+				initialPublishingList += ',';
+			initialPublishingList += node[i]->id;
 		}
 
-#ifdef HOMIELIB_VERBOSE
-		if (debug)
-			csprintf("NODES: %s\n", strNodes.c_str());
-#endif
+		HOMIE_LOGD("NODES: %s\n", initialPublishingList.c_str());
 
-		bError |= 0 == Publish(String(topic + "/$nodes").c_str(), ipub_qos, true, strNodes.c_str());
+		bError |= 0 == Publish(GetTopic(szTopic, sizeof(szTopic), "/$nodes"), ipub_qos, true, initialPublishingList.c_str());
 
 		if (bError)
 		{
@@ -433,29 +1091,30 @@ void HomieDevice::DoInitialPublishing()
 		int i = initialPublishing_Node;
 		if (i < (int)node.size())
 		{
-			HomieNode &node = *node[i];
-#ifdef HOMIELIB_VERBOSE
-			if (debug)
-				csprintf("NODE %i: %s\n", i, node.friendlyName.c_str());
-#endif
+			HomieNode &node = *this->node[i];
+			HOMIE_LOGD("NODE %i: %s\n", i, node.friendlyName.c_str());
 
-			bError |= 0 == Publish(String(node.topic + "/$name").c_str(), ipub_qos, true, node.friendlyName.c_str());
-			bError |= 0 == Publish(String(node.topic + "/$type").c_str(), ipub_qos, true, node.type.c_str());
+			bError |= 0 == Publish(node.GetTopic(szTopic, sizeof(szTopic), "/$name"), ipub_qos, true, node.friendlyName.c_str());
+			bError |= 0 == Publish(node.GetTopic(szTopic, sizeof(szTopic), "/$type"), ipub_qos, true, node.type.c_str());
+			if (node.IsArray())
+			{
+				snprintf(szValue, sizeof(szValue), "0-%i", node.arraySize - 1);
+				bError |= 0 == Publish(node.GetTopic(szTopic, sizeof(szTopic), "/$array"), ipub_qos, true, szValue);
+			}
 
-			String strProperties;
+			initialPublishingList = "";
 			for (size_t j = 0; j < node.vecProperty.size(); j++)
 			{
-				strProperties += node.vecProperty[j]->id;
-				if (j < node.vecProperty.size() - 1)
-					strProperties += ",";
+				if (!node.vecProperty[j]->initialized)
+					continue; //a datatype $array nodes can't hold
+				if (initialPublishingList.length())
+					initialPublishingList += ',';
+				initialPublishingList += node.vecProperty[j]->id;
 			}
 
-#ifdef HOMIELIB_VERBOSE
-			if (debug)
-				csprintf("NODE %i: %s has properties %s\n", i, node.friendlyName.c_str(), strProperties.c_str());
-#endif
+			HOMIE_LOGD("NODE %i: %s has properties %s\n", i, node.friendlyName.c_str(), initialPublishingList.c_str());
 
-			bError |= 0 == Publish(String(node.topic + "/$properties").c_str(), ipub_qos, true, strProperties.c_str());
+			bError |= 0 == Publish(node.GetTopic(szTopic, sizeof(szTopic), "/$properties"), ipub_qos, true, initialPublishingList.c_str());
 
 			if (bError)
 			{
@@ -474,6 +1133,7 @@ void HomieDevice::DoInitialPublishing()
 			initialPublishing = 4;
 			initialPublishing_Node = 0;
 			initialPublishing_Prop = 0;
+			initialPublishing_Index = 0;
 		}
 	}
 
@@ -484,65 +1144,106 @@ void HomieDevice::DoInitialPublishing()
 
 		if (i < (int)node.size())
 		{
-			HomieNode &node = *node[i];
-#ifdef HOMIELIB_VERBOSE
-			if (debug)
-				csprintf("NODE %i: %s\n", i, node.friendlyName.c_str());
-#endif
+			HomieNode &node = *this->node[i];
+			HOMIE_LOGD("NODE %i: %s\n", i, node.friendlyName.c_str());
 
 			int j = initialPublishing_Prop;
 			if (j < (int)node.vecProperty.size())
 			{
 				HomieProperty &prop = *node.vecProperty[j];
 
-#ifdef HOMIELIB_VERBOSE
-				if (debug)
-					csprintf("NODE %i: %s property %s\n", i, node.friendlyName.c_str(), prop.friendlyName.c_str());
-#endif
+				HOMIE_LOGD("NODE %i: %s property %s\n", i, node.friendlyName.c_str(), prop.friendlyName.c_str());
+
+				if (!prop.initialized)
+				{
+					initialPublishing_Prop++; //left out by Init, not in $properties either
+					return;
+				}
+
+				if (initialPublishing_Index > 0)
+				{
+					//$array values, a batch per step
+					int index = initialPublishing_Index - 1;
+					for (int k = 0; k < ipub_array_batch && index < node.arraySize; k++, index++)
+					{
+						bError |= false == prop.PublishArray(index);
+						initialPublishingMessages++;
+					}
+
+					if (bError)
+					{
+						HandleInitialPublishingError();
+					}
+					else if (index >= node.arraySize)
+					{
+						initialPublishing_Index = 0;
+						initialPublishing_Prop++;
+						pubCount_Props++;
+					}
+					else
+					{
+						initialPublishing_Index = index + 1;
+					}
+
+					return;
+				}
 
 				if (prop.standardMQTT)
 				{
-#ifdef HOMIELIB_VERBOSE
-					csprintf("SUBSCRIBING to MQTT topic %s\n", prop.topic.c_str());
-#endif
-					bError |= 0 == mqtt.subscribe(prop.topic.c_str(), sub_qos);
-					incoming[prop.topic] = &prop;
+					HOMIE_LOGV("SUBSCRIBING to MQTT topic %s\n", prop.topic.c_str());
+					bError |= 0 == Subscribe(prop.topic.c_str(), sub_qos);
+					HOMIE_ALLOC_SCOPE(homieAllocIncoming);
+					Incoming()[prop.topic] = &prop;
 				}
 				else
 				{
 
-					bError |= 0 == Publish(String(prop.topic + "/$name").c_str(), ipub_qos, true, prop.friendlyName.c_str());
-					bError |= 0 == Publish(String(prop.topic + "/$settable").c_str(), ipub_qos, true, prop.settable ? "true" : "false");
-					bError |= 0 == Publish(String(prop.topic + "/$retained").c_str(), ipub_qos, true, prop.retained ? "true" : "false");
-					bError |= 0 == Publish(String(prop.topic + "/$datatype").c_str(), ipub_qos, true, GetHomieDataTypeText(prop.datatype));
+					bError |= 0 == Publish(prop.GetTopic(szTopic, sizeof(szTopic), "/$name"), ipub_qos, true, prop.friendlyName.c_str());
+					bError |= 0 == Publish(prop.GetTopic(szTopic, sizeof(szTopic), "/$settable"), ipub_qos, true, prop.settable ? "true" : "false");
+					bError |= 0 == Publish(prop.GetTopic(szTopic, sizeof(szTopic), "/$retained"), ipub_qos, true, prop.retained ? "true" : "false");
+					bError |= 0 == Publish(prop.GetTopic(szTopic, sizeof(szTopic), "/$datatype"), ipub_qos, true, GetHomieDataTypeText(prop.datatype));
 					if (prop.unit.length())
 					{
-						bError |= 0 == Publish(String(prop.topic + "/$unit").c_str(), ipub_qos, true, prop.unit.c_str());
+						bError |= 0 == Publish(prop.GetTopic(szTopic, sizeof(szTopic), "/$unit"), ipub_qos, true, prop.unit.c_str());
 					}
 					if (prop.strFormat.length())
 					{
-						bError |= 0 == Publish(String(prop.topic + "/$format").c_str(), ipub_qos, true, prop.strFormat.c_str());
+						bError |= 0 == Publish(prop.GetTopic(szTopic, sizeof(szTopic), "/$format"), ipub_qos, true, prop.strFormat.c_str());
 					}
 
-					if (prop.settable)
+					if (node.IsArray())
+					{
+						if (prop.settable)
+						{
+							//one subscription covers every index, DispatchProperty maps it to the slot
+							int len = snprintf(szTopic, sizeof(szTopic), "%s/+/%s/set", topic.c_str(), prop.id.c_str());
+							if (len < 0 || (size_t)len >= sizeof(szTopic))
+							{
+								HOMIE_LOGE("Topic of %s/%s doesn't fit in %u bytes\n", node.id.c_str(), prop.id.c_str(), (unsigned int)sizeof(szTopic));
+								bError = true;
+							}
+							else
+							{
+								HOMIE_LOGV("SUBSCRIBING to %s\n", szTopic);
+								bError |= 0 == Subscribe(szTopic, sub_qos);
+							}
+						}
+					}
+					else if (prop.settable)
 					{
-						incoming[prop.topic] = &prop;
-						incoming[prop.setTopic] = &prop;
+						//both topics dispatch through the index, see DispatchProperty
 						if (prop.retained)
 						{
-#ifdef HOMIELIB_VERBOSE
-							csprintf("SUBSCRIBING to %s\n", prop.topic.c_str());
-#endif
-							bError |= 0 == mqtt.subscribe(prop.topic.c_str(), sub_qos);
+							HOMIE_LOGV("SUBSCRIBING to %s\n", prop.GetTopic(szTopic, sizeof(szTopic)));
+							bError |= 0 == Subscribe(szTopic, sub_qos);
 						}
-#ifdef HOMIELIB_VERBOSE
-						csprintf("SUBSCRIBING to %s\n", prop.setTopic.c_str());
-#endif
-						bError |= 0 == mqtt.subscribe(prop.setTopic.c_str(), sub_qos);
+						HOMIE_LOGV("SUBSCRIBING to %s\n", prop.GetTopic(szTopic, sizeof(szTopic), "/set"));
+						bError |= 0 == Subscribe(szTopic, sub_qos);
 					}
 					else
 					{
 						bError |= false == prop.Publish();
+						initialPublishingMessages++;
 					}
 				}
 
@@ -550,6 +1251,10 @@ void HomieDevice::DoInitialPublishing()
 				{
 					HandleInitialPublishingError();
 				}
+				else if (node.IsArray())
+				{
+					initialPublishing_Index = 1; //continue with the values
+				}
 				else
 				{
 					initialPublishing_Prop++;
@@ -577,7 +1282,7 @@ void HomieDevice::DoInitialPublishing()
 	if (initialPublishing == 5)
 	{
 		bool bError = false;
-		bError |= 0 == Publish(String(topic + "/$state").c_str(), ipub_qos, true, "ready");
+		bError |= 0 == Publish(szWillTopic, ipub_qos, true, "ready");
 
 		if (bError)
 		{
@@ -586,10 +1291,13 @@ void HomieDevice::DoInitialPublishing()
 		else
 		{
 			doInitialPublishing = false;
-			csprintf("Initial publishing complete. %i nodes, %i properties\n", node.size(), pubCount_Props);
-			FinishInitialPublishing(this);
+			HOMIE_LOGI("Initial publishing complete. %i nodes, %i properties\n", (int)node.size(), pubCount_Props);
+			if (!IsConnectionPublishing())
+				FinishInitialPublishing(pGateway ? pGateway : this); //the last device done gives up the connection's turn
 
 			initialPublishingDone = true;
+			timeToReady = millis() - initialPublishingStart;
+			HOMIE_METRIC_RECORD(metrics, homieHistogramTimeToReady_ms, timeToReady);
 
 			publishDefaultsTimestamp = millis() + 5000;
 			doPublishDefaults = true;
@@ -599,7 +1307,12 @@ void HomieDevice::DoInitialPublishing()
 
 uint16_t HomieDevice::PublishDirect(const String &topic, uint8_t qos, bool retain, const String &payload)
 {
-	return mqtt.publish(topic.c_str(), qos, retain, payload.c_str(), payload.length());
+	return Mqtt().publish(topic.c_str(), qos, retain, payload.c_str(), payload.length());
+}
+
+uint16_t HomieDevice::PublishDirect(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length)
+{
+	return Mqtt().publish(topic, qos, retain, payload, length);
 }
 
 bool bFailPublish = false;
@@ -610,15 +1323,20 @@ uint16_t HomieDevice::Publish(const char *topic, uint8_t qos, bool retain, const
 		return 0;
 	uint16_t ret = 0;
 
-	if (!bFailPublish)
+	if (doInitialPublishing)
 	{
-		ret = mqtt.publish(topic, qos, retain, payload, length, dup, message_id);
+		initialPublishingMessages++;
 	}
 
-	//csprintf("Publish %s: ret %i\n",topic,ret);
+	if (!bFailPublish)
+	{
+		ret = Mqtt().publish(topic, qos, retain, payload, length, dup, message_id);
+	}
 
 	if (!ret)
 	{ //failure
+		HOMIE_METRIC_INC(metrics, homieCounterPublishFailed);
+
 		if (!sendError)
 		{
 			sendError = true;
@@ -628,8 +1346,17 @@ uint16_t HomieDevice::Publish(const char *topic, uint8_t qos, bool retain, const
 		{
 			if ((int)(millis() - sendErrorTimestamp) > 60000) //a full minute with no successes
 			{
-				csprintf("Full minute with no publish successes, disconnect and try again\n");
-				mqtt.disconnect(true);
+				HOMIE_LOGE("Full minute with no publish successes, disconnect and try again\n");
+				if (pGateway)
+				{
+					pGateway->mqtt.disconnect(true);
+					pGateway->sendError = false;
+					pGateway->connecting = false;
+				}
+				else
+				{
+					mqtt.disconnect(true);
+				}
 				sendError = false;
 				connecting = false;
 			}
@@ -637,12 +1364,170 @@ uint16_t HomieDevice::Publish(const char *topic, uint8_t qos, bool retain, const
 	}
 	else
 	{ //success
+		HOMIE_METRIC_INC(metrics, homieCounterPublish);
 		sendError = false;
+
+		if (qos == 1)
+		{
+			(pGateway ? pGateway : this)->health.OnPublishSent(ret);
+		}
 	}
 
 	return ret;
 }
 
+void HomieDevice::AddStat(const char *id, HomieStatCallback getter, unsigned long interval_ms, uint8_t qos, double threshold)
+{
+	HOMIE_ALLOC_SCOPE(homieAllocTree);
+	HomieStat stat;
+	stat.id = id;
+	stat.getter = getter;
+	stat.interval_ms = interval_ms;
+	stat.qos = qos;
+	stat.threshold = threshold;
+	stat.lastValue = 0;
+	stat.lastTimestamp = 0;
+	stat.published = false;
+	vecStat.push_back(stat);
+}
+
+void HomieDevice::AddBuiltinStats()
+{
+	if (builtinStatsAdded)
+		return;
+	builtinStatsAdded = true;
+
+	//built-ins go first, in front of anything the application added
+	std::vector<HomieStat> vecUser;
+	vecUser.swap(vecStat);
+
+	AddStat("uptime", [this]() { return (double)secondCounter_Uptime; }, statsInterval_ms);
+	AddStat("signal", []() { return (double)WiFi.RSSI(); }, bRapidUpdateRSSI ? 2000 : statsInterval_ms);
+	AddStat("uptime-wifi", [this]() { return (double)secondCounter_WiFi; }, statsInterval_ms);
+	AddStat("uptime-mqtt", [this]() { return (double)secondCounter_MQTT; }, statsInterval_ms);
+	if (!pGateway)
+	{
+		//published every probe interval whether it changed or not, its PUBACK is the next RTT sample
+		AddStat("rtt", [this]() { return (double)health.GetRTT_ms(); }, health.probeInterval_ms, 1, -1);
+	}
+
+#ifdef HOMIELIB_METRICS
+	if (bPublishMetrics)
+	{
+		for (int a = 0; a < homieCounterCount; a++)
+		{
+			eHomieCounter counter = (eHomieCounter)a;
+			AddStat(HomieMetrics::GetCounterName(counter), [this, counter]() { return (double)metrics.GetCounter(counter); }, statsInterval_ms);
+		}
+
+		for (int a = 0; a < homieHistogramCount; a++)
+		{
+			eHomieHistogram histogram = (eHomieHistogram)a;
+			String strName = HomieMetrics::GetHistogramName(histogram);
+			AddStat(String(strName + "-p50").c_str(), [this, histogram]() { return (double)metrics.GetHistogram(histogram).GetPercentile(50); }, statsInterval_ms);
+			AddStat(String(strName + "-p99").c_str(), [this, histogram]() { return (double)metrics.GetHistogram(histogram).GetPercentile(99); }, statsInterval_ms);
+		}
+	}
+#endif
+
+	vecStat.insert(vecStat.end(), vecUser.begin(), vecUser.end());
+}
+
+const char *HomieDevice::GetTopic(char *szOut, size_t size, const char *szSuffix)
+{
+	int len = snprintf(szOut, size, "%s%s", topic.c_str(), szSuffix);
+	if (len < 0 || (size_t)len >= size)
+	{
+		HOMIE_LOGE("Topic of %s doesn't fit in %u bytes\n", id.c_str(), (unsigned int)size);
+		*szOut = 0;
+	}
+	return szOut;
+}
+
+void HomieDevice::ReserveInitialPublishingList()
+{
+	//the longest comma separated list initial publishing sends
+	size_t longest = 0;
+	size_t len = 0;
+	for (size_t i = 0; i < vecStat.size(); i++)
+	{
+		len += vecStat[i].id.length() + 1;
+	}
+	longest = std::max(longest, len);
+
+	len = 0;
+	for (size_t a = 0; a < node.size(); a++)
+	{
+		len += node[a]->id.length() + 1;
+
+		size_t properties = 0;
+		for (size_t b = 0; b < node[a]->vecProperty.size(); b++)
+		{
+			properties += node[a]->vecProperty[b]->id.length() + 1;
+		}
+		longest = std::max(longest, properties);
+	}
+	longest = std::max(longest, len);
+
+	initialPublishingList.reserve(longest);
+}
+
+void HomieDevice::PublishStats()
+{
+	HOMIE_ALLOC_SCOPE(homieAllocStats);
+
+	if (IsLaneBusy(homieLaneStats))
+		return; //stats lane priority, after everything queued on the connection
+
+	for (size_t i = 0; i < vecStat.size(); i++)
+	{
+		HomieStat &stat = vecStat[i];
+
+		if (stat.published && (millis() - stat.lastTimestamp) < stat.interval_ms)
+			continue;
+
+		double value = stat.getter();
+
+		if (stat.published && fabs(value - stat.lastValue) <= stat.threshold)
+		{
+			stat.lastTimestamp = millis(); //unchanged, look again next interval
+			continue;
+		}
+
+		//most stats are counters and byte counts, those skip the float formatting
+		char szValue[HOMIE_NUMERIC_BUFFER];
+		bool bIntegral = value >= INT32_MIN && value <= INT32_MAX && value == (double)(int32_t)value;
+		if (!(bIntegral ? HomieFormatInt(szValue, sizeof(szValue), (int32_t)value) : HomieFormatFloat(szValue, sizeof(szValue), value)))
+			continue;
+
+		if (!stat.topic.length())
+		{
+			stat.topic = topic + "/$stats/" + stat.id;
+		}
+
+		if (Publish(stat.topic.c_str(), stat.qos, true, szValue))
+		{
+			stat.published = true;
+			stat.lastValue = value;
+			stat.lastTimestamp = millis();
+		}
+		else
+		{
+			stat.lastTimestamp = millis() - stat.interval_ms + GetErrorRetryFrequency(); //retry in a while
+		}
+	}
+}
+
+uint16_t HomieDevice::Subscribe(const char *topic, uint8_t qos)
+{
+	if (doInitialPublishing)
+	{
+		initialPublishingMessages++;
+	}
+
+	return Mqtt().subscribe(topic, qos);
+}
+
 String HomieDeviceName(const char *in)
 {
 	String ret;
@@ -696,155 +1581,262 @@ String HomieDeviceName(const char *in)
 	return ret;
 }
 
-bool HomieParseRGB(const char *in, uint32_t &rgb)
+int HomieDevice::GetErrorRetryFrequency()
 {
-	int r, g, b;
-
-	if (sscanf(in, "%d,%d,%d", &r, &g, &b) == 3)
+	int iErrorDuration = (int)(millis() - sendErrorTimestamp);
+	if (iErrorDuration >= 20000)
 	{
-		rgb = (r << 16) + (g << 8) + (b << 0);
-		return true;
+		return 10000;
 	}
-	return false;
+	if (iErrorDuration >= 5000)
+	{
+		return 5000;
+	}
+
+	return 1000;
 }
 
-void HSVtoRGB(float fHueIn, float fSatIn, float fBriteIn, float &fRedOut, float &fGreenOut, float &fBlueOut)
+unsigned long HomieDevice::GetUptimeSeconds_WiFi()
 {
-	float fHue = (float)fmod(fHueIn / 6.0f, 60);
-	float fC = fBriteIn * fSatIn;
-	float fL = fBriteIn - fC;
-	float fX = (float)(fC * (1.0f - fabs(fmod(fHue * 0.1f, 2.0f) - 1.0f)));
+	return secondCounter_WiFi;
+}
 
-	if (fHue >= 0.0f && fHue < 10.0f)
-	{
-		fRedOut = fC;
-		fGreenOut = fX;
-		fBlueOut = 0;
-	}
-	else if (fHue >= 10.0f && fHue < 20.0f)
-	{
-		fRedOut = fX;
-		fGreenOut = fC;
-		fBlueOut = 0;
-	}
-	else if (fHue >= 20.0f && fHue < 30.0f)
-	{
-		fRedOut = 0;
-		fGreenOut = fC;
-		fBlueOut = fX;
-	}
-	else if (fHue >= 30.0f && fHue < 40.0f)
+unsigned long HomieDevice::GetUptimeSeconds_MQTT()
+{
+	return secondCounter_MQTT;
+}
+
+bool HomieDevice::IsConnectionPublishing()
+{
+	HomieDevice *pOwner = pGateway ? pGateway : this;
+	if (pOwner->initialized && pOwner->doInitialPublishing)
+		return true;
+
+	for (size_t a = 0; a < pOwner->vecVirtualDevice.size(); a++)
 	{
-		fRedOut = 0;
-		fGreenOut = fX;
-		fBlueOut = fC;
+		HomieDevice *pDevice = pOwner->vecVirtualDevice[a];
+		if (pDevice->initialized && pDevice->doInitialPublishing)
+			return true;
 	}
-	else if (fHue >= 40.0f && fHue < 50.0f)
+	return false;
+}
+
+unsigned long HomieDevice::GetInitialPublishingWaitTotal_ms()
+{
+	return initialPublishingWaitTotal;
+}
+
+unsigned long HomieDevice::GetInitialPublishingWaitMax_ms()
+{
+	return initialPublishingWaitMax;
+}
+
+unsigned long HomieDevice::GetSuppressedPublishes()
+{
+	unsigned long ret = 0;
+	for (size_t a = 0; a < node.size(); a++)
 	{
-		fRedOut = fX;
-		fGreenOut = 0;
-		fBlueOut = fC;
+		for (size_t b = 0; b < node[a]->vecProperty.size(); b++)
+		{
+			ret += node[a]->vecProperty[b]->suppressedPublishes;
+		}
 	}
-	else if (fHue >= 50.0f && fHue < 60.0f)
+	return ret;
+}
+
+unsigned long HomieDevice::GetDroppedEchoes()
+{
+	unsigned long ret = 0;
+	for (size_t a = 0; a < node.size(); a++)
 	{
-		fRedOut = fC;
-		fGreenOut = 0;
-		fBlueOut = fX;
+		for (size_t b = 0; b < node[a]->vecProperty.size(); b++)
+		{
+			ret += node[a]->vecProperty[b]->droppedEchoes;
+		}
 	}
-	else
+	return ret;
+}
+
+unsigned long HomieDevice::GetSuppressedCallbacks()
+{
+	unsigned long ret = 0;
+	for (size_t a = 0; a < node.size(); a++)
 	{
-		fRedOut = 0;
-		fGreenOut = 0;
-		fBlueOut = 0;
+		for (size_t b = 0; b < node[a]->vecProperty.size(); b++)
+		{
+			ret += node[a]->vecProperty[b]->suppressedCallbacks;
+		}
 	}
+	return ret;
+}
 
-	fRedOut += fL;
-	fGreenOut += fL;
-	fBlueOut += fL;
+unsigned long HomieDevice::GetTimeToReady_ms()
+{
+	return timeToReady;
 }
 
-bool HomieParseHSV(const char *in, uint32_t &rgb)
+unsigned long HomieDevice::GetReconnectInterval()
 {
-	int h, s, v;
+	return health.GetReconnectDelay_ms();
+}
 
-	if (sscanf(in, "%d,%d,%d", &h, &s, &v) == 3)
-	{
-		float fR, fG, fB;
+eHomieHealthState HomieDevice::GetHealthState()
+{
+	return (pGateway ? pGateway : this)->health.GetState();
+}
 
-		HSVtoRGB(h, s * 0.01f, v * 0.01f, fR, fG, fB);
+unsigned long HomieDevice::GetRTT_ms()
+{
+	return (pGateway ? pGateway : this)->health.GetRTT_ms();
+}
 
-		int r = fR * 256.0f;
-		int g = fG * 256.0f;
-		int b = fB * 256.0f;
+void HomieDevice::setServer(IPAddress ip, uint16_t port, const char *username, const char *password)
+{
+	vecBroker.clear();
+	currentBroker = 0;
+	addServer(ip, port, username, password);
+}
 
-		if (r > 255)
-			r = 255;
-		if (g > 255)
-			g = 255;
-		if (b > 255)
-			b = 255;
+void HomieDevice::setServer(const char *host, uint16_t port, const char *username, const char *password)
+{
+	vecBroker.clear();
+	currentBroker = 0;
+	addServer(host, port, username, password);
+}
 
-		rgb = (r << 16) + (g << 8) + (b << 0);
-		return true;
-	}
-	return false;
+void HomieDevice::addServer(IPAddress ip, uint16_t port, const char *username, const char *password)
+{
+	HomieBroker broker = {};
+	broker.useIp = true;
+	broker.ip = ip;
+	broker.port = port;
+	vecBroker.push_back(broker);
+	setServerCredentials(username, password);
 }
 
-int HomieDevice::GetErrorRetryFrequency()
+void HomieDevice::addServer(const char *host, uint16_t port, const char *username, const char *password)
 {
-	int iErrorDuration = (int)(millis() - sendErrorTimestamp);
-	if (iErrorDuration >= 20000)
+	HomieBroker broker = {};
+	broker.useIp = false;
+	broker.host = host;
+	broker.port = port;
+	vecBroker.push_back(broker);
+	setServerCredentials(username, password);
+}
+
+void HomieDevice::setServerCredentials(const char *username, const char *password)
+{
+	if (!vecBroker.size())
+		return;
+	vecBroker.back().username = username;
+	vecBroker.back().password = password;
+}
+
+void HomieDevice::ApplyBroker()
+{
+	if (currentBroker >= vecBroker.size())
+		return;
+
+	HomieBroker &broker = vecBroker[currentBroker];
+	if (broker.useIp)
 	{
-		return 10000;
+		mqtt.setServer(broker.ip, broker.port);
 	}
-	if (iErrorDuration >= 5000)
+	else
 	{
-		return 5000;
+		mqtt.setServer(broker.host, broker.port);
 	}
-
-	return 1000;
+	mqtt.setCredentials(broker.username, broker.password);
 }
 
-unsigned long HomieDevice::GetUptimeSeconds_WiFi()
+uint8_t HomieDevice::GetRecentFailures(HomieBroker &broker)
 {
-	return secondCounter_WiFi;
+	unsigned long halvings = failureDecay_ms ? (millis() - broker.failureTimestamp) / failureDecay_ms : 0;
+	return halvings >= 8 ? 0 : broker.failures >> halvings;
 }
 
-unsigned long HomieDevice::GetUptimeSeconds_MQTT()
+unsigned long HomieDevice::GetBrokerScore(size_t index)
 {
-	return secondCounter_MQTT;
-}
+	if (index >= vecBroker.size())
+		return (unsigned long)-1;
 
-unsigned long HomieDevice::GetReconnectInterval()
-{
-	unsigned long interval = 5000;
-	if (mqttReconnectCount >= 20)
-		interval = 60000;
-	else if (mqttReconnectCount >= 15)
-		interval = 30000;
-	else if (mqttReconnectCount >= 10)
-		interval = 20000;
-	else if (mqttReconnectCount >= 5)
-		interval = 10000;
-	return interval;
+	HomieBroker &broker = vecBroker[index];
+	unsigned long rtt = (index == currentBroker && mqtt.connected()) ? health.GetRTT_ms() : broker.rtt_ms;
+	return index * brokerPreference_ms + broker.connectLatency_ms + 2 * rtt + GetRecentFailures(broker) * failurePenalty_ms;
 }
 
-void HomieDevice::setServer(IPAddress ip, uint8_t port, const char *username = NULL, const char *password = NULL)
+void HomieDevice::SelectBroker(bool bFailedAttempt)
 {
-	this->useIp = true;
-	this->setServerCredentials(username, password);
-	this->mqttServerIP = ip;
-	this->mqttServerPort = port;
+	if (currentBroker >= vecBroker.size())
+	{
+		health.OnDisconnected(bFailedAttempt);
+		return;
+	}
+
+	HomieBroker &broker = vecBroker[currentBroker];
+	if (!bFailedAttempt)
+	{
+		broker.rtt_ms = health.GetRTT_ms();
+	}
+
+	bool bFailback = failbackBroker < vecBroker.size();
+	if (!bFailback && (bFailedAttempt || health.GetState() == homieHealthStalled))
+	{
+		uint8_t failures = GetRecentFailures(broker);
+		broker.failures = failures < 255 ? failures + 1 : failures;
+		broker.failureTimestamp = millis();
+	}
+
+	size_t previous = currentBroker;
+	if (bFailback)
+	{
+		currentBroker = failbackBroker;
+		failbackBroker = (size_t)-1;
+	}
+	else
+	{
+		for (size_t i = 0; i < vecBroker.size(); i++)
+		{
+			if (GetBrokerScore(i) < GetBrokerScore(currentBroker))
+			{
+				currentBroker = i;
+			}
+		}
+	}
+
+	if (currentBroker != previous && !GetRecentFailures(vecBroker[currentBroker]))
+	{
+		HOMIE_LOGW("Switching from MQTT server %u to %u\n", (unsigned)previous, (unsigned)currentBroker);
+		health.OnDisconnected(false); //nothing wrong with this one yet, no reason to back off
+	}
+	else
+	{
+		health.OnDisconnected(bFailedAttempt);
+	}
 }
-void HomieDevice::setServer(const char *host, uint8_t port, const char *username = NULL, const char *password = NULL)
+
+void HomieDevice::CheckFailback()
 {
-	this->useIp = false;
-	this->setServerCredentials(username, password);
-	this->mqttServerHost = host;
-	this->mqttServerPort = port;
+	if (!currentBroker || (millis() - failbackTimestamp) < failbackInterval_ms)
+		return;
+	failbackTimestamp = millis();
+
+	for (size_t i = 0; i < currentBroker; i++)
+	{
+		if (!GetRecentFailures(vecBroker[i]) && GetBrokerScore(i) < GetBrokerScore(currentBroker))
+		{
+			HOMIE_LOGI("Failing back to MQTT server %u\n", (unsigned)i);
+
+			//leave cleanly, the will would have this broker report us lost
+			for (size_t a = 0; a < vecVirtualDevice.size(); a++)
+			{
+				vecVirtualDevice[a]->Publish(vecVirtualDevice[a]->szWillTopic, 1, true, "disconnected");
+			}
+			Publish(szWillTopic, 1, true, "disconnected");
+
+			failbackBroker = i;
+			mqtt.disconnect(false);
+			return;
+		}
+	}
 }
-void HomieDevice::setServerCredentials(const char *username, const char *password)
-{
-	this->mqttUsername = username;
-	this->mqttPassword = password;
-}
\ No newline at end of file
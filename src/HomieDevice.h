@@ -2,7 +2,18 @@
 
 #include "AsyncMqttClient.h"
 #include "HomieNode.h"
+#include "HomieColor.h"
+#include "HomieMetrics.h"
+#include "HomieLog.h"
+#include "HomieIndex.h"
+#include "HomieArena.h"
+#include "HomieHealth.h"
+#include "HomieTopicAlias.h"
 #include <map>
+#include <atomic>
+#if !defined(ARDUINO_ARCH_ESP8266) && !defined(ARDUINO_ARCH_ESP32)
+#include <thread>
+#endif
 
 
 #if defined(ARDUINO_ARCH_ESP8266)
@@ -11,74 +22,252 @@
 #include "WiFi.h"
 #endif
 
-#define HOMIELIB_VERBOSE
-
 typedef std::map<String, HomieProperty *> _map_incoming;
 
-typedef std::function<void(const char *szText)> HomieDebugPrintCallback;
+typedef std::function<double()> HomieStatCallback;
 
-void HomieLibRegisterDebugPrintCallback(HomieDebugPrintCallback cb);
+struct HomieStat
+{
+	String id;
+	HomieStatCallback getter;
+	unsigned long interval_ms;
+	uint8_t qos;
+	double threshold; //only republish when the value moved by more than this
 
-String HomieDeviceName(const char *in);
+	String topic;
+	double lastValue;
+	unsigned long lastTimestamp;
+	bool published;
+};
+
+struct HomieBroker
+{
+	bool useIp;
+	IPAddress ip;
+	const char *host;
+	uint16_t port;
+	const char *username;
+	const char *password;
+
+	unsigned long connectLatency_ms; //smoothed time from connect to CONNACK, 0 until the first connect
+	unsigned long rtt_ms;			 //publish round-trip time at the end of the last session
+	uint8_t failures;				 //failed attempts and stalls, halved every failureDecay_ms
+	unsigned long failureTimestamp;
+	unsigned long connects;
+};
 
-bool HomieParseRGB(const char *in, uint32_t &rgb);
-bool HomieParseHSV(const char *in, uint32_t &rgb);
+String HomieDeviceName(const char *in);
 
 class HomieDevice
 {
 public:
 	HomieDevice();
+	~HomieDevice();
 
 	int iInitialPublishingThrottle_ms = 200;
 
-	bool bRapidUpdateRSSI = false;
+	//Devices in one process take turns at initial publishing in round-robin order.
+	//Each turn lasts until the device has sent iInitialPublishingBudget*iInitialPublishingWeight messages.
+	int iInitialPublishingBudget = 8;
+	int iInitialPublishingWeight = 1;
+
+	//A gateway's virtual devices share this many initial publishing steps per 100ms tick, handed out round-robin.
+	//The gateway's own step comes on top. Each step is a few messages, or one property's attributes.
+	int iGatewayStepsPerTick = 8;
+
+	bool bRapidUpdateRSSI = false; //check signal every 2 seconds instead of every statsInterval_ms
+
+	//$state is republished and the built-in stats are checked this often, also published as $stats/interval
+	unsigned long statsInterval_ms = 30000;
+
+	//Publish $stats/<id>. When a stat is due its getter is called, and the value is only published if it moved by
+	//more than threshold since the last publish. Everything due is published in the same loop.
+	void AddStat(const char *id, HomieStatCallback getter, unsigned long interval_ms = 30000, uint8_t qos = 1, double threshold = 0);
 
 	void Init();
 	void Quit();
 
 	void Loop();
 
+	//Worker mode: Loop runs on its own FreeRTOS task (ESP32) or thread (host) instead of being called by the sketch.
+	//SetValue, SetInt, SetFloat, SetBool and the color setters may then be called from any thread. The values are
+	//handed to the worker through a lock-free queue that keeps only the latest value per property, so producers
+	//never wait for the network or for each other. Each property gets HOMIELIB_PENDING_SLOTS value slots of
+	//valueCapacity bytes (or the datatype's default) here, longer values are dropped with a warning.
+	//Not available on ESP8266. Call after Init, on the gateway for virtual devices.
+	bool StartWorker(unsigned long interval_ms = 5, uint32_t stackSize = 8192, int priority = 1, int core = 1);
+	void StopWorker();
+	bool IsWorkerRunning() { return workerRunning; }
+
+	//Static memory mode, set before Init. Property values get fixed buffers (see HomieProperty::valueCapacity),
+	//longer values are rejected instead of growing them, so SetValue, /set dispatch, stats, heartbeats and
+	//reconnects don't allocate once the first initial publishing is done. extras/host/AllocTest.cpp checks this.
+	bool bStaticMemory = false;
+
+	HomieMetrics metrics;
+	bool bPublishMetrics = false; //also publish the metrics as stats, set before Init
+
+	//Round-trip time, stall detection and reconnect backoff of this device's own connection. Settings go on the
+	//gateway for virtual devices, the getters below report the gateway's.
+	HomieHealthMonitor health;
+	eHomieHealthState GetHealthState();
+	unsigned long GetRTT_ms();
+
+	//MQTT 5 topic aliases for the hottest property topics, on the connection owner like health. Off unless
+	//topicAliases.bEnabled is set. The broker never grants any over AsyncMqttClient's MQTT 3.1.1, so for now it
+	//only estimates, GetBytesSavable() reports what they would save.
+	HomieTopicAliases topicAliases;
+
 	HomieNode *NewNode();
 
+	//Capacity hint, call before creating the tree. Nodes and properties then come from one block instead of
+	//one heap allocation each, anything beyond the hint falls back to the heap.
+	void Reserve(size_t nodes, size_t properties);
+
+	//Quit if needed and destroy all nodes and properties. The block is kept, so a new tree can be built
+	//and Init called again without going back to the heap.
+	void Clear();
+
+	//Lookup by id, through a hash index built in Init (or on first use before that)
+	HomieNode *FindNode(const char *id);
+	HomieProperty *FindProperty(const char *path); //"node/property"
+	size_t GetNodeCount() { return node.size(); }
+	HomieNode *GetNode(size_t index) { return index < node.size() ? node[index] : NULL; }
+
 	bool IsConnected();
+	bool IsInitialPublishingDone() { return initialPublishingDone; } //$state=ready sent since the last connect
 
 	uint16_t PublishDirect(const String &topic, uint8_t qos, bool retain, const String &payload);
+	uint16_t PublishDirect(const char *topic, uint8_t qos, bool retain, const char *payload, size_t length);
 
 	AsyncMqttClient mqtt;
 
+	String friendlyName;
+	String id;
+
+	//Gateway mode: call before Init to have this device share pGateway's MQTT connection instead of opening its own.
+	//The gateway drives the Loop of its virtual devices, so only call Loop on the gateway.
+	//There is only one LWT per connection, so the gateway's $state carries it and virtual devices republish their
+	//$state as a heartbeat every stats interval. Controllers should treat a virtual device whose heartbeat stops as lost.
+	void SetGateway(HomieDevice *pGateway);
+	bool IsVirtual() { return pGateway != NULL; }
+
 	unsigned long GetUptimeSeconds_WiFi();
 	unsigned long GetUptimeSeconds_MQTT();
 
-	void setServer(IPAddress ip, uint8_t port, const char *username = NULL, const char *password = NULL);
-	void setServer(const char* host, uint8_t port, const char *username = NULL, const char *password = NULL);
-	void setServerCredentials(const char *username, const char *password);
+	unsigned long GetInitialPublishingWaitTotal_ms();	//time this device spent waiting for its connection's turn since the last connect
+	unsigned long GetInitialPublishingWaitMax_ms();		//longest single wait of this device for a turn since the last connect
+	unsigned long GetTimeToReady_ms();					//connect to $state=ready, last completed round
 
-private:
-	uint16_t Publish(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t length = 0, bool dup = false, uint16_t message_id = 0);
+	unsigned long GetSuppressedPublishes(); //totals over all properties, see HomieProperty::publishMode
+	unsigned long GetSuppressedCallbacks();
+	unsigned long GetDroppedEchoes(); //own publishes received back and dropped before dispatch
 
-	friend class HomieNode;
-	friend class HomieProperty;
+	//setServer replaces the broker list with one broker, addServer appends a fallback. Brokers are scored by list
+	//order, connect latency, publish RTT and recent failures (lower is better), each connect goes to the best one.
+	//While on a fallback, a preferred broker that scores better is tried again every failbackInterval_ms.
+	void setServer(IPAddress ip, uint16_t port, const char *username = NULL, const char *password = NULL);
+	void setServer(const char* host, uint16_t port, const char *username = NULL, const char *password = NULL);
+	void addServer(IPAddress ip, uint16_t port, const char *username = NULL, const char *password = NULL);
+	void addServer(const char *host, uint16_t port, const char *username = NULL, const char *password = NULL);
+	void setServerCredentials(const char *username, const char *password); //for the broker added last
 
-	bool useIp = true;
-	const char *mqttServerHost;
-	IPAddress mqttServerIp;
-	uint8_t mqttServerPort;
+	unsigned long brokerPreference_ms = 2000; //score added per place in the list
+	unsigned long failurePenalty_ms = 30000;  //score added per recent failure
+	unsigned long failureDecay_ms = 60000;
+	unsigned long failbackInterval_ms = 300000;
 
-	const char *mqttUsername;
-	const char *mqttPassword;
+	//The new broker has none of our retained topics, so initial publishing runs at this pace after a switch
+	int iFailoverPublishingThrottle_ms = 20;
 
-	String friendlyName;
-	String id;
+	size_t GetBrokerCount() { return vecBroker.size(); }
+	const HomieBroker *GetBroker(size_t index) { return index < vecBroker.size() ? &vecBroker[index] : NULL; }
+	size_t GetCurrentBroker() { return currentBroker; }
+	unsigned long GetBrokerScore(size_t index);
+
+private:
+	uint16_t Publish(const char *topic, uint8_t qos, bool retain, const char *payload = nullptr, size_t length = 0, bool dup = false, uint16_t message_id = 0);
+
+	uint16_t Subscribe(const char *topic, uint8_t qos);
 
+	friend class HomieNode;
+	friend class HomieDiscovery;
+	friend class HomieProperty;
+	friend bool AllowInitialPublishing(HomieDevice *pSource);
+	friend void ChargeInitialPublishing(HomieDevice *pSource, unsigned long messages);
+	friend void FinishInitialPublishing(HomieDevice *pSource);
+
+	std::vector<HomieBroker> vecBroker;
+	size_t currentBroker = 0;
+	size_t sessionBroker = (size_t)-1; //broker of the last established connection
+	bool brokerChanged = false;			//this session is on a different broker than the one before
+	size_t failbackBroker = (size_t)-1; //set while we leave a fallback for a preferred broker
+	unsigned long failbackTimestamp = 0;
+
+	void ApplyBroker();
+	void SelectBroker(bool bFailedAttempt); //after a disconnect, picks the broker and the delay for the next connect
+	uint8_t GetRecentFailures(HomieBroker &broker);
+	void CheckFailback();
+
+	AsyncMqttClient &Mqtt();	//the connection this device publishes on, its own or the gateway's
+	_map_incoming &Incoming();	//the dispatch index shared by everything on that connection
+	HomieDevice &Owner() { return pGateway ? *pGateway : *this; } //the device that owns that connection and its lanes
+	HomieTopicAliases &TopicAliases() { return pGateway ? pGateway->topicAliases : topicAliases; }
+	std::vector<HomieProperty *> vecAliasCandidate;
+	void RebalanceTopicAliases();
+
+	HomieDevice *pGateway = NULL;
+	std::vector<HomieDevice *> vecVirtualDevice;
+	size_t gatewayLoopOffset = 0;
+	int gatewayStepsLeft = 0; //initial publishing steps its virtual devices may still take this tick
+	bool gatewaySecondTick = false;
+	bool gatewayDeciSecondTick = false;
+
+	void DoLoop();
+
+	std::atomic<bool> workerRunning{false};
+	unsigned long workerInterval_ms = 5;
+	//set by the worker itself once it runs, so nobody reads it while the task or thread is still being created
+#if defined(ARDUINO_ARCH_ESP32)
+	std::atomic<TaskHandle_t> workerTask{NULL};
+	std::atomic<bool> workerAlive{false};
+	static void WorkerTask(void *pParam);
+#elif !defined(ARDUINO_ARCH_ESP8266)
+	std::thread workerThread;
+	std::atomic<std::thread::id> workerThreadId{std::thread::id()};
+#endif
+	bool IsWorkerThread();
+	bool ShouldQueueValues(); //true on any thread but the worker while it runs
+
+	std::atomic<HomieProperty *> pendingHead{NULL}; //properties with a queued value, newest first
+	void QueueProperty(HomieProperty *pProp);
+	void ApplyQueuedValues();
+
+	std::vector<HomieProperty *> vecLane[homieLaneMeta]; //deferred property publishes of the connection, metadata has no queue
+	bool IsLaneBusy(eHomiePublishLane lane);			 //anything queued on the connection at this priority or above
+	void QueuePublish(HomieProperty *pProp);
+	bool FlushLanes(); //connection owner only, false while something is still waiting
+	void DropFromLanes(); //our properties, before they go away
 	void DoInitialPublishing();
+	bool IsConnectionPublishing(); //the gateway or one of its virtual devices has initial publishing left
+	const char *GetTopic(char *szOut, size_t size, const char *szSuffix); //homie/<device><suffix>, empty if it doesn't fit
+	void ReserveInitialPublishingList();
+	void AddBuiltinStats();
+	void PublishStats();
+
+	std::vector<HomieStat> vecStat;
+	bool builtinStatsAdded = false;
+	void DoInitialPublishingStep();
 
-	unsigned long mqttReconnectCount = 0;
 	unsigned long homieStatsTimestamp = 0;
 	unsigned long lastReconnect = 0;
 
 	void onConnect(bool sessionPresent);
 	void onDisconnect(AsyncMqttClientDisconnectReason reason);
+	void onPublish(uint16_t packetId);
 	void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total);
+	bool OwnsTopic(const char *szTopic); //under our or a virtual device's base topic
+	bool DispatchProperty(char *szTopic, char *payload, AsyncMqttClientMessageProperties &properties, size_t len, size_t total);
 
 	bool connecting = false;
 
@@ -89,21 +278,35 @@ private:
 	int initialPublishing = 0;
 	int initialPublishing_Node = 0;
 	int initialPublishing_Prop = 0;
+	int initialPublishing_Index = 0; //next $array value + 1, 0 while publishing property attributes
 
 	int pubCount_Props = 0;
 
-	unsigned long initialPublishing = 0;
+	unsigned long initialPublishingTimestamp = 0;
 
-	unsigned long connectTimestamp = 0;
+	unsigned long initialPublishingMessages = 0; //messages sent by initial publishing, charged against the scheduler budget
+	unsigned long initialPublishingTurnUsed = 0;
+	unsigned long initialPublishingWaitStart = 0;
+	unsigned long initialPublishingWaitTotal = 0;
+	unsigned long initialPublishingWaitMax = 0;
+	unsigned long initialPublishingStart = 0;
+	unsigned long timeToReady = 0;
 
-	bool debug = false;
+	unsigned long connectTimestamp = 0;
 
 	bool initialized = false;
+	bool callbacksRegistered = false;
 
 	String topic;
 	char szWillTopic[128];
+	String initialPublishingList; //$nodes, $properties and $stats payloads, reused so a reconnect doesn't allocate
 
 	std::vector<HomieNode *> node;
+	HomieArena arena;
+
+	HomieIndex index;
+	HomieIndex &Index();
+	HomieProperty *FindProperty(const char *nodeId, size_t nodeLen, const char *propId, size_t propLen);
 
 	_map_incoming incoming;
 
@@ -0,0 +1,480 @@
+#include "HomieDiscovery.h"
+#include "HomieDevice.h"
+#include "HomieIndex.h"
+#include "HomieNumeric.h"
+
+static const uint8_t discovery_qos = 1;
+
+static void Assign(String &out, const char *payload, size_t len)
+{
+	out = "";
+	out.concat(payload, len);
+}
+
+static bool Equals(const char *payload, size_t len, const char *sz)
+{
+	return strlen(sz) == len && !memcmp(payload, sz, len);
+}
+
+static bool Equals(const String &str, const char *id, size_t len)
+{
+	return str.length() == len && !memcmp(str.c_str(), id, len);
+}
+
+static uint32_t HashChild(uint32_t parentHash, const char *id, size_t len)
+{
+	return HomieHash(id, len, HomieHash("/", 1, parentHash));
+}
+
+uint32_t HomieRemoteProperty::GetRGB()
+{
+	int32_t c[3];
+	if (datatype != homieColor || !HomieParseTriplet(value.c_str(), value.length(), c))
+		return 0;
+
+	if (strFormat == "hsv")
+		return HomieHSVtoRGB((uint16_t)c[0], (uint8_t)c[1], (uint8_t)c[2]);
+	return (c[0] << 16) + (c[1] << 8) + (c[2] << 0);
+}
+
+HomieHSV HomieRemoteProperty::GetHSV()
+{
+	int32_t c[3];
+	if (datatype == homieColor && strFormat == "hsv" && HomieParseTriplet(value.c_str(), value.length(), c))
+	{
+		HomieHSV hsv = {(uint16_t)c[0], (uint8_t)c[1], (uint8_t)c[2]};
+		return hsv;
+	}
+	return HomieRGBtoHSV(GetRGB());
+}
+
+HomieRemoteNode::~HomieRemoteNode()
+{
+	for (size_t i = 0; i < vecProperty.size(); i++)
+	{
+		delete vecProperty[i];
+	}
+}
+
+HomieRemoteProperty *HomieRemoteNode::FindProperty(const char *id)
+{
+	for (size_t i = 0; i < vecProperty.size(); i++)
+	{
+		if (vecProperty[i]->id == id)
+			return vecProperty[i];
+	}
+	return NULL;
+}
+
+HomieRemoteDevice::~HomieRemoteDevice()
+{
+	for (size_t i = 0; i < vecNode.size(); i++)
+	{
+		delete vecNode[i];
+	}
+}
+
+HomieRemoteNode *HomieRemoteDevice::FindNode(const char *id)
+{
+	for (size_t i = 0; i < vecNode.size(); i++)
+	{
+		if (vecNode[i]->id == id)
+			return vecNode[i];
+	}
+	return NULL;
+}
+
+HomieRemoteProperty *HomieRemoteDevice::FindProperty(const char *path)
+{
+	const char *slash = strchr(path, '/');
+	if (!slash)
+		return NULL;
+
+	for (size_t i = 0; i < vecNode.size(); i++)
+	{
+		if (Equals(vecNode[i]->id, path, slash - path))
+			return vecNode[i]->FindProperty(slash + 1);
+	}
+	return NULL;
+}
+
+HomieDiscovery::~HomieDiscovery()
+{
+	for (size_t i = 0; i < vecDevice.size(); i++)
+	{
+		delete vecDevice[i];
+	}
+}
+
+void HomieDiscovery::Begin(HomieDevice &local)
+{
+	Begin(local.Mqtt(), &local);
+}
+
+void HomieDiscovery::Begin(AsyncMqttClient &mqtt, HomieDevice *pLocal)
+{
+	if (pMqtt)
+		return;
+
+	pMqtt = &mqtt;
+	this->pLocal = pLocal;
+	mqtt.onConnect(std::bind(&HomieDiscovery::onConnect, this, std::placeholders::_1));
+	mqtt.onMessage(std::bind(&HomieDiscovery::onMqttMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3, std::placeholders::_4, std::placeholders::_5, std::placeholders::_6));
+
+	if (mqtt.connected())
+		onConnect(false);
+}
+
+void HomieDiscovery::OnDevice(HomieDiscoveryDeviceCallback cb)
+{
+	vecDeviceCallback.push_back(cb);
+}
+
+void HomieDiscovery::OnValue(HomieDiscoveryValueCallback cb)
+{
+	vecValueCallback.push_back(cb);
+}
+
+HomieRemoteDevice *HomieDiscovery::FindDevice(const char *id)
+{
+	return FindDevice(id, strlen(id));
+}
+
+HomieRemoteProperty *HomieDiscovery::FindProperty(const char *path)
+{
+	const char *slash = strchr(path, '/');
+	if (!slash)
+		return NULL;
+
+	HomieRemoteDevice *pDevice = FindDevice(path, slash - path);
+	return pDevice ? pDevice->FindProperty(slash + 1) : NULL;
+}
+
+HomieDiscovery::Entry *HomieDiscovery::Find(uint32_t hash, HomieRemoteDevice *pDevice, HomieRemoteNode *pNode, const char *id, size_t len)
+{
+	if (!table.size())
+		return NULL;
+
+	size_t mask = table.size() - 1;
+
+	for (size_t i = hash & mask; table[i].pDevice; i = (i + 1) & mask)
+	{
+		Entry &entry = table[i];
+		if (entry.hash != hash)
+			continue;
+
+		if (pNode)
+		{
+			if (entry.pNode == pNode && entry.pProperty && Equals(entry.pProperty->id, id, len))
+				return &entry;
+		}
+		else if (pDevice)
+		{
+			if (entry.pDevice == pDevice && entry.pNode && !entry.pProperty && Equals(entry.pNode->id, id, len))
+				return &entry;
+		}
+		else if (!entry.pNode && Equals(entry.pDevice->id, id, len))
+		{
+			return &entry;
+		}
+	}
+
+	return NULL;
+}
+
+void HomieDiscovery::Insert(const Entry &entry)
+{
+	if ((tableCount + 1) * 2 > table.size())
+	{
+		//entries keep their hash, so rehashing doesn't need the tree
+		std::vector<Entry> old;
+		old.swap(table);
+
+		Entry empty = {0, NULL, NULL, NULL};
+		table.assign(old.size() ? old.size() * 2 : 16, empty);
+		tableCount = 0;
+
+		for (size_t i = 0; i < old.size(); i++)
+		{
+			if (old[i].pDevice)
+				Insert(old[i]);
+		}
+	}
+
+	size_t mask = table.size() - 1;
+	size_t i = entry.hash & mask;
+	while (table[i].pDevice)
+	{
+		i = (i + 1) & mask;
+	}
+	table[i] = entry;
+	tableCount++;
+}
+
+HomieRemoteDevice *HomieDiscovery::FindDevice(const char *id, size_t len)
+{
+	Entry *pEntry = Find(HomieHash(id, len), NULL, NULL, id, len);
+	return pEntry ? pEntry->pDevice : NULL;
+}
+
+HomieRemoteDevice *HomieDiscovery::AddDevice(const char *id, size_t len)
+{
+	HomieRemoteDevice *pDevice = new HomieRemoteDevice;
+	Assign(pDevice->id, id, len);
+	pDevice->hash = HomieHash(id, len);
+	vecDevice.push_back(pDevice);
+
+	Entry entry = {pDevice->hash, pDevice, NULL, NULL};
+	Insert(entry);
+	return pDevice;
+}
+
+HomieRemoteNode *HomieDiscovery::GetNode(HomieRemoteDevice *pDevice, const char *id, size_t len)
+{
+	uint32_t hash = HashChild(pDevice->hash, id, len);
+	Entry *pEntry = Find(hash, pDevice, NULL, id, len);
+	if (pEntry)
+		return pEntry->pNode;
+
+	HomieRemoteNode *pNode = new HomieRemoteNode;
+	Assign(pNode->id, id, len);
+	pNode->parent = pDevice;
+	pNode->hash = hash;
+	pDevice->vecNode.push_back(pNode);
+
+	Entry entry = {hash, pDevice, pNode, NULL};
+	Insert(entry);
+	return pNode;
+}
+
+HomieRemoteProperty *HomieDiscovery::GetProperty(HomieRemoteNode *pNode, const char *id, size_t len)
+{
+	uint32_t hash = HashChild(pNode->hash, id, len);
+	Entry *pEntry = Find(hash, pNode->parent, pNode, id, len);
+	if (pEntry)
+		return pEntry->pProperty;
+
+	HomieRemoteProperty *pProp = new HomieRemoteProperty;
+	Assign(pProp->id, id, len);
+	pProp->parent = pNode;
+	pNode->vecProperty.push_back(pProp);
+
+	Entry entry = {hash, pNode->parent, pNode, pProp};
+	Insert(entry);
+	return pProp;
+}
+
+void HomieDiscovery::Subscribe(HomieRemoteDevice *pDevice)
+{
+	String strTopic = String("homie/") + pDevice->id + "/#";
+	pMqtt->subscribe(strTopic.c_str(), discovery_qos);
+}
+
+void HomieDiscovery::onConnect(bool sessionPresent)
+{
+	if (sessionPresent) //squelch unused parameter warning
+	{
+	}
+
+	pMqtt->subscribe("homie/+/$homie", discovery_qos);
+	for (size_t i = 0; i < vecDevice.size(); i++)
+	{
+		Subscribe(vecDevice[i]);
+	}
+}
+
+void HomieDiscovery::onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total)
+{
+	if (properties.retain || total) //squelch unused parameter warnings
+	{
+	}
+
+	if (index != 0 || strncmp(topic, "homie/", 6))
+		return;
+
+	if (pLocal)
+	{
+		//SetGateway may come after Begin, so resolve the connection owner here
+		HomieDevice *pOwner = pLocal->pGateway ? pLocal->pGateway : pLocal;
+		if (pOwner->OwnsTopic(topic))
+			return;
+	}
+
+	//homie/<device>/...
+	const char *szId = topic + 6;
+	const char *szIdEnd = strchr(szId, '/');
+	if (!szIdEnd)
+		return;
+
+	const char *szRest = szIdEnd + 1;
+	HomieRemoteDevice *pDevice = FindDevice(szId, szIdEnd - szId);
+
+	if (!strcmp(szRest, "$homie"))
+	{
+		if (!pDevice && len)
+		{
+			if (maxDevices && vecDevice.size() >= maxDevices)
+			{
+				HOMIE_LOGW("Not following %.*s, already following %u devices\n", (int)(szIdEnd - szId), szId, (unsigned int)maxDevices);
+				return;
+			}
+
+			pDevice = AddDevice(szId, szIdEnd - szId);
+			Subscribe(pDevice);
+			HOMIE_LOGD("Discovered %s\n", pDevice->id.c_str());
+
+			for (size_t i = 0; i < vecDeviceCallback.size(); i++)
+			{
+				vecDeviceCallback[i](pDevice);
+			}
+		}
+		return;
+	}
+
+	if (!pDevice)
+		return;
+
+	if (*szRest == '$')
+	{
+		OnDeviceAttribute(pDevice, szRest, payload, len);
+		return;
+	}
+
+	//<node>/$attribute, <node>/<property> or <node>/<property>/<attribute>
+	const char *szNodeEnd = strchr(szRest, '/');
+	if (!szNodeEnd)
+		return;
+
+	HomieRemoteNode *pNode = GetNode(pDevice, szRest, szNodeEnd - szRest);
+	const char *szSub = szNodeEnd + 1;
+
+	if (*szSub == '$')
+	{
+		OnNodeAttribute(pNode, szSub, payload, len);
+		return;
+	}
+
+	const char *szPropEnd = strchr(szSub, '/');
+	HomieRemoteProperty *pProp = GetProperty(pNode, szSub, szPropEnd ? szPropEnd - szSub : strlen(szSub));
+
+	if (szPropEnd)
+	{
+		OnPropertyAttribute(pProp, szPropEnd + 1, payload, len);
+		return;
+	}
+
+	//an empty payload clears the retained value, keep the last one
+	if (!len || !AssignValue(pProp, payload, len))
+		return;
+
+	for (size_t i = 0; i < vecValueCallback.size(); i++)
+	{
+		vecValueCallback[i](pDevice, pProp);
+	}
+}
+
+void HomieDiscovery::OnDeviceAttribute(HomieRemoteDevice *pDevice, const char *szAttribute, const char *payload, size_t len)
+{
+	if (!strcmp(szAttribute, "$name"))
+	{
+		Assign(pDevice->friendlyName, payload, len);
+	}
+	else if (!strcmp(szAttribute, "$state"))
+	{
+		Assign(pDevice->state, payload, len);
+	}
+	else if (!strcmp(szAttribute, "$nodes"))
+	{
+		const char *szEnd = payload + len;
+		for (const char *szNode = payload; szNode < szEnd;)
+		{
+			const char *szComma = (const char *)memchr(szNode, ',', szEnd - szNode);
+			if (!szComma)
+				szComma = szEnd;
+			if (szComma > szNode)
+				GetNode(pDevice, szNode, szComma - szNode);
+			szNode = szComma + 1;
+		}
+	}
+}
+
+void HomieDiscovery::OnNodeAttribute(HomieRemoteNode *pNode, const char *szAttribute, const char *payload, size_t len)
+{
+	if (!strcmp(szAttribute, "$name"))
+	{
+		Assign(pNode->friendlyName, payload, len);
+	}
+	else if (!strcmp(szAttribute, "$type"))
+	{
+		Assign(pNode->type, payload, len);
+	}
+	else if (!strcmp(szAttribute, "$properties"))
+	{
+		const char *szEnd = payload + len;
+		for (const char *szProp = payload; szProp < szEnd;)
+		{
+			const char *szComma = (const char *)memchr(szProp, ',', szEnd - szProp);
+			if (!szComma)
+				szComma = szEnd;
+			if (szComma > szProp)
+				GetProperty(pNode, szProp, szComma - szProp);
+			szProp = szComma + 1;
+		}
+	}
+}
+
+void HomieDiscovery::OnPropertyAttribute(HomieRemoteProperty *pProp, const char *szAttribute, const char *payload, size_t len)
+{
+	bool bRevalidate = false;
+
+	if (!strcmp(szAttribute, "$name"))
+	{
+		Assign(pProp->friendlyName, payload, len);
+	}
+	else if (!strcmp(szAttribute, "$datatype"))
+	{
+		eHomieDataType datatype;
+		if (HomieParseDataType(payload, len, datatype) && datatype != pProp->datatype)
+		{
+			pProp->datatype = datatype;
+			bRevalidate = true;
+		}
+	}
+	else if (!strcmp(szAttribute, "$format"))
+	{
+		Assign(pProp->strFormat, payload, len);
+		bRevalidate = true;
+	}
+	else if (!strcmp(szAttribute, "$unit"))
+	{
+		Assign(pProp->unit, payload, len);
+	}
+	else if (!strcmp(szAttribute, "$settable"))
+	{
+		pProp->settable = Equals(payload, len, "true");
+	}
+	else if (!strcmp(szAttribute, "$retained"))
+	{
+		pProp->retained = !Equals(payload, len, "false");
+	}
+	//"set" is the controllers' own traffic
+
+	if (bRevalidate && pProp->value.length())
+	{
+		//the value may have arrived before its $datatype or $format, normalize it now. Invalid values stay as they were.
+		String strValue = pProp->value;
+		AssignValue(pProp, strValue.c_str(), strValue.length());
+	}
+}
+
+bool HomieDiscovery::AssignValue(HomieRemoteProperty *pProp, const char *payload, size_t len)
+{
+	//same validation and normalization as a local /set, but nothing is published back
+	char szTemp[HOMIE_NUMERIC_BUFFER];
+	const char *szValue = HomieConstrainPayload(pProp->datatype, pProp->strFormat, -1, pProp->friendlyName.c_str(), payload, len, szTemp, sizeof(szTemp));
+	if (!szValue || Equals(pProp->value, szValue, len))
+		return false;
+
+	Assign(pProp->value, szValue, len);
+	return true;
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include "Arduino.h"
+#include "AsyncMqttClient.h"
+#include "HomieNode.h"
+
+#include <vector>
+
+class HomieRemoteDevice;
+class HomieRemoteNode;
+class HomieDiscovery;
+
+//A property of a remote device: its attributes and the last valid value. Values are validated against the remote
+//$datatype and $format like a local /set.
+class HomieRemoteProperty
+{
+public:
+	String id;
+	String friendlyName;
+	String unit;
+	String strFormat;
+	eHomieDataType datatype = homieString;
+	bool settable = false;
+	bool retained = true;
+
+	HomieRemoteNode *GetNode() { return parent; }
+
+	const String &GetValue() { return value; }
+	uint32_t GetRGB(); //color values per $format (rgb or hsv), 0 until there is one
+	HomieHSV GetHSV();
+
+private:
+	HomieRemoteNode *parent = NULL;
+	String value;
+
+	friend class HomieDiscovery;
+};
+
+class HomieRemoteNode
+{
+public:
+	~HomieRemoteNode();
+
+	String id;
+	String friendlyName;
+	String type;
+
+	HomieRemoteDevice *GetDevice() { return parent; }
+
+	size_t GetPropertyCount() { return vecProperty.size(); }
+	HomieRemoteProperty *GetProperty(size_t index) { return index < vecProperty.size() ? vecProperty[index] : NULL; }
+	HomieRemoteProperty *FindProperty(const char *id);
+
+private:
+	HomieRemoteDevice *parent = NULL;
+	uint32_t hash = 0; //of "<device>/<id>", continued for property lookups
+	std::vector<HomieRemoteProperty *> vecProperty;
+
+	friend class HomieDiscovery;
+};
+
+//What HomieDiscovery keeps of a device on the broker. It has no connection of its own, all remotes share the
+//discovery's client.
+class HomieRemoteDevice
+{
+public:
+	~HomieRemoteDevice();
+
+	String id;
+	String friendlyName;
+
+	const String &GetState() { return state; } //$state, empty until received
+
+	size_t GetNodeCount() { return vecNode.size(); }
+	HomieRemoteNode *GetNode(size_t index) { return index < vecNode.size() ? vecNode[index] : NULL; }
+	HomieRemoteNode *FindNode(const char *id);
+	HomieRemoteProperty *FindProperty(const char *path); //"node/property"
+
+private:
+	String state;
+	uint32_t hash = 0; //of id, continued for node lookups
+	std::vector<HomieRemoteNode *> vecNode;
+
+	friend class HomieDiscovery;
+};
+
+typedef std::function<void(HomieRemoteDevice *pDevice)> HomieDiscoveryDeviceCallback;
+typedef std::function<void(HomieRemoteDevice *pDevice, HomieRemoteProperty *pProperty)> HomieDiscoveryValueCallback;
+
+//Controller side: follows the other homie devices on the broker.
+//Nodes and properties are created as the attributes come in, in any order, and each message costs a hash lookup for
+//the device and one for the node or property. Instances of $array nodes show up as separate nodes.
+//Remotes keep only their ids, attributes and values, a property is 176 bytes plus a 32 byte table entry on a 64 bit
+//host, before the strings' text. Set maxDevices on small controllers anyway, so a busy broker can't use up the heap.
+class HomieDiscovery
+{
+public:
+	~HomieDiscovery();
+
+	size_t maxDevices = 0; //devices announced beyond this many are ignored, 0 for no limit
+
+	//Share a client, e.g. a HomieDevice's mqtt, or the gateway's for virtual devices. Keep the discovery alive
+	//as long as the client. Pass the device that publishes on it, otherwise the discovery follows that device
+	//too and its own values come back to it through the homie/<id>/# subscription.
+	void Begin(AsyncMqttClient &mqtt, HomieDevice *pLocal = NULL);
+	void Begin(HomieDevice &local); //shares the local device's connection, the gateway's for a virtual device
+
+	void OnDevice(HomieDiscoveryDeviceCallback cb); //a device announced $homie for the first time
+	void OnValue(HomieDiscoveryValueCallback cb);	//any remote value changed
+
+	size_t GetDeviceCount() { return vecDevice.size(); }
+	HomieRemoteDevice *GetDevice(size_t index) { return index < vecDevice.size() ? vecDevice[index] : NULL; }
+	HomieRemoteDevice *FindDevice(const char *id);
+	HomieRemoteProperty *FindProperty(const char *path); //"device/node/property"
+
+private:
+	//one open addressing table for all devices, nodes and properties, at most half full.
+	//Device entries have no pNode, node entries no pProperty.
+	struct Entry
+	{
+		uint32_t hash;
+		HomieRemoteDevice *pDevice;
+		HomieRemoteNode *pNode;
+		HomieRemoteProperty *pProperty;
+	};
+
+	AsyncMqttClient *pMqtt = NULL;
+	HomieDevice *pLocal = NULL; //never followed, nor its gateway's other virtual devices
+	std::vector<HomieRemoteDevice *> vecDevice;
+	std::vector<Entry> table;
+	size_t tableCount = 0;
+	std::vector<HomieDiscoveryDeviceCallback> vecDeviceCallback;
+	std::vector<HomieDiscoveryValueCallback> vecValueCallback;
+
+	Entry *Find(uint32_t hash, HomieRemoteDevice *pDevice, HomieRemoteNode *pNode, const char *id, size_t len); //a child of pNode, else of pDevice, else a device
+	void Insert(const Entry &entry);
+
+	HomieRemoteDevice *FindDevice(const char *id, size_t len);
+	HomieRemoteDevice *AddDevice(const char *id, size_t len);
+	HomieRemoteNode *GetNode(HomieRemoteDevice *pDevice, const char *id, size_t len);
+	HomieRemoteProperty *GetProperty(HomieRemoteNode *pNode, const char *id, size_t len);
+	void Subscribe(HomieRemoteDevice *pDevice);
+
+	void onConnect(bool sessionPresent);
+	void onMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total);
+	void OnDeviceAttribute(HomieRemoteDevice *pDevice, const char *szAttribute, const char *payload, size_t len);
+	void OnNodeAttribute(HomieRemoteNode *pNode, const char *szAttribute, const char *payload, size_t len);
+	void OnPropertyAttribute(HomieRemoteProperty *pProp, const char *szAttribute, const char *payload, size_t len);
+	bool AssignValue(HomieRemoteProperty *pProp, const char *payload, size_t len); //returns whether the value changed
+};
@@ -0,0 +1,142 @@
+#include "HomieHealth.h"
+#include "HomieLog.h"
+
+const char *HomieHealthGetStateName(eHomieHealthState state)
+{
+	switch (state)
+	{
+	default:
+		return "invalid";
+	case homieHealthDisconnected:
+		return "disconnected";
+	case homieHealthConnecting:
+		return "connecting";
+	case homieHealthHealthy:
+		return "healthy";
+	case homieHealthDegraded:
+		return "degraded";
+	case homieHealthStalled:
+		return "stalled";
+	}
+}
+
+void HomieHealthMonitor::OnConnecting()
+{
+	state = homieHealthConnecting;
+}
+
+void HomieHealthMonitor::OnConnected()
+{
+	state = homieHealthHealthy;
+	srtt = 0;
+	rttvar = 0;
+	samples = 0;
+	sampling = false;
+	backoff = 0;
+}
+
+void HomieHealthMonitor::OnDisconnected(bool bFailedAttempt)
+{
+	state = homieHealthDisconnected;
+	sampling = false;
+
+	if (bFailedAttempt)
+	{
+		//decorrelated jitter: random between base and three times the last wait
+		unsigned long lower = backoffBase_ms;
+		unsigned long upper = backoff ? backoff * 3 : backoffBase_ms * 3;
+		if (upper > backoffCap_ms)
+			upper = backoffCap_ms;
+		backoff = upper > lower ? (unsigned long)random(lower, upper + 1) : lower;
+		reconnectDelay = backoff;
+	}
+	else
+	{
+		//a lost connection is usually lost by everyone at once, spread the first attempt over one base interval
+		reconnectDelay = random(backoffBase_ms + 1);
+	}
+}
+
+void HomieHealthMonitor::OnPublishSent(uint16_t packetId)
+{
+	if (sampling || !packetId || packetId == lastAckedPacketId)
+		return;
+
+	sampling = true;
+	samplePacketId = packetId;
+	sampleTimestamp = millis();
+}
+
+void HomieHealthMonitor::OnPublishAcked(uint16_t packetId)
+{
+	lastAckedPacketId = packetId;
+
+	if (!sampling || packetId != samplePacketId)
+		return;
+
+	unsigned long rtt = millis() - sampleTimestamp;
+	sampling = false;
+
+	//RFC 6298 smoothing, in whole milliseconds
+	if (!samples)
+	{
+		srtt = rtt;
+		rttvar = rtt / 2;
+	}
+	else
+	{
+		unsigned long delta = rtt > srtt ? rtt - srtt : srtt - rtt;
+		rttvar = (3 * rttvar + delta) / 4;
+		srtt = (7 * srtt + rtt) / 8;
+	}
+	samples++;
+
+	if (state == homieHealthDegraded)
+	{
+		HOMIE_LOGI("Connection recovered, rtt %lums\n", rtt);
+		state = homieHealthHealthy;
+	}
+}
+
+unsigned long HomieHealthMonitor::GetRTO_ms()
+{
+	if (!samples)
+		return initialRTO_ms;
+
+	unsigned long variance = 4 * rttvar;
+	if (variance < granularity_ms)
+		variance = granularity_ms;
+
+	unsigned long rto = srtt + variance;
+	return rto < minRTO_ms ? minRTO_ms : rto;
+}
+
+bool HomieHealthMonitor::CheckStall()
+{
+	if (!sampling || state == homieHealthStalled)
+		return false;
+
+	unsigned long rto = GetRTO_ms();
+	unsigned long outstanding = millis() - sampleTimestamp;
+
+	unsigned long stallTimeout = rto * stallRTOs;
+	if (stallTimeout < stallMin_ms)
+		stallTimeout = stallMin_ms;
+
+	if (outstanding >= stallTimeout)
+	{
+		HOMIE_LOGE("No acknowledgement for %lums (rtt %lums), connection stalled\n", outstanding, srtt);
+		state = homieHealthStalled;
+		sampling = false;
+		stalls++;
+		return true;
+	}
+
+	if (outstanding >= rto && state == homieHealthHealthy)
+	{
+		HOMIE_LOGW("Acknowledgement overdue, %lums (rto %lums)\n", outstanding, rto);
+		state = homieHealthDegraded;
+	}
+
+	return false;
+}
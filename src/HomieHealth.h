@@ -0,0 +1,71 @@
+#pragma once
+#include "Arduino.h"
+#include <atomic>
+
+enum eHomieHealthState
+{
+	homieHealthDisconnected,
+	homieHealthConnecting,
+	homieHealthHealthy,
+	homieHealthDegraded, //an acknowledgement is overdue by more than one RTO
+	homieHealthStalled,	 //no acknowledgement for stallRTOs RTOs, the connection gets dropped
+	homieHealthStateCount,
+};
+
+const char *HomieHealthGetStateName(eHomieHealthState state);
+
+//Watches one MQTT connection. The round-trip time is measured from a QoS 1 publish to its PUBACK, one sample
+//in flight at a time, and smoothed like TCP does (srtt, rttvar). A sample that stays unacknowledged for several
+//retransmission timeouts means the connection is half-open. Reconnect delays use decorrelated jitter, so a fleet
+//that lost its broker at the same moment doesn't come back in lock-step.
+class HomieHealthMonitor
+{
+public:
+	//each failed attempt waits a random time between base and three times the previous wait, capped
+	unsigned long backoffBase_ms = 2000;
+	unsigned long backoffCap_ms = 60000;
+
+	//RTO is srtt+max(granularity_ms,4*rttvar) but at least minRTO_ms (RFC 6298). The granularity covers the loop
+	//and network task delays a PUBACK sees before it's timed, so a steady link doesn't shrink the RTO to the srtt.
+	unsigned long minRTO_ms = 1000;
+	unsigned long granularity_ms = 100;
+	unsigned long initialRTO_ms = 3000; //until the first sample
+
+	//stalled once a sample is outstanding for stallRTOs RTOs, but never sooner than stallMin_ms
+	int stallRTOs = 4;
+	unsigned long stallMin_ms = 5000;
+
+	//the device publishes $stats/rtt this often with QoS 1, which keeps a sample going on an idle connection
+	unsigned long probeInterval_ms = 10000;
+
+	void OnConnecting();
+	void OnConnected();
+	void OnDisconnected(bool bFailedAttempt); //picks the next reconnect delay
+	void OnPublishSent(uint16_t packetId);	  //QoS 1 only
+	void OnPublishAcked(uint16_t packetId);
+	bool CheckStall(); //true once when the sample is overdue, the caller drops the connection
+
+	eHomieHealthState GetState() { return state; }
+	unsigned long GetRTT_ms() { return srtt; } //smoothed, 0 until the first sample
+	unsigned long GetRTTVariance_ms() { return rttvar; }
+	unsigned long GetRTO_ms();
+	unsigned long GetReconnectDelay_ms() { return reconnectDelay; }
+	unsigned long GetSamples() { return samples; }
+	unsigned long GetStalls() { return stalls; }
+
+private:
+	eHomieHealthState state = homieHealthDisconnected;
+
+	unsigned long srtt = 0;
+	unsigned long rttvar = 0;
+	unsigned long samples = 0; //since the last connect
+	unsigned long stalls = 0;
+
+	bool sampling = false;
+	uint16_t samplePacketId = 0;
+	unsigned long sampleTimestamp = 0;
+	std::atomic<uint16_t> lastAckedPacketId{0}; //acks arrive on the network task and can beat OnPublishSent
+
+	unsigned long reconnectDelay = 0;
+	unsigned long backoff = 0; //last wait after a failed attempt, 0 after a success
+};
@@ -0,0 +1,115 @@
+#include "HomieIndex.h"
+#include "HomieNode.h"
+
+uint32_t HomieHash(const char *in, size_t len, uint32_t hash)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)in[i];
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static uint32_t HashProperty(const char *nodeId, size_t nodeLen, const char *propId, size_t propLen)
+{
+	uint32_t hash = HomieHash(nodeId, nodeLen);
+	hash = HomieHash("/", 1, hash);
+	return HomieHash(propId, propLen, hash);
+}
+
+static bool Equals(const String &str, const char *in, size_t len)
+{
+	return str.length() == len && !memcmp(str.c_str(), in, len);
+}
+
+void HomieIndex::Build(const std::vector<HomieNode *> &vecNode)
+{
+	size_t count = vecNode.size();
+	for (size_t a = 0; a < vecNode.size(); a++)
+	{
+		count += vecNode[a]->vecProperty.size();
+	}
+
+	//power of two, at most half full
+	size_t size = 8;
+	while (size < count * 2)
+		size <<= 1;
+
+	Entry empty = {0, NULL, NULL};
+	table.assign(size, empty);
+
+	for (size_t a = 0; a < vecNode.size(); a++)
+	{
+		HomieNode *pNode = vecNode[a];
+		Insert(HomieHash(pNode->id.c_str(), pNode->id.length()), pNode, NULL);
+
+		for (size_t b = 0; b < pNode->vecProperty.size(); b++)
+		{
+			HomieProperty *pProp = pNode->vecProperty[b];
+			Insert(HashProperty(pNode->id.c_str(), pNode->id.length(), pProp->id.c_str(), pProp->id.length()), pNode, pProp);
+		}
+	}
+
+	built = true;
+}
+
+void HomieIndex::Insert(uint32_t hash, HomieNode *pNode, HomieProperty *pProperty)
+{
+	size_t mask = table.size() - 1;
+	size_t i = hash & mask;
+	while (table[i].pNode)
+	{
+		i = (i + 1) & mask;
+	}
+
+	table[i].hash = hash;
+	table[i].pNode = pNode;
+	table[i].pProperty = pProperty;
+}
+
+HomieNode *HomieIndex::FindNode(const char *id, size_t len)
+{
+	if (!table.size())
+		return NULL;
+
+	uint32_t hash = HomieHash(id, len);
+	size_t mask = table.size() - 1;
+
+	for (size_t i = hash & mask; table[i].pNode; i = (i + 1) & mask)
+	{
+		const Entry &entry = table[i];
+		if (entry.hash == hash && !entry.pProperty && Equals(entry.pNode->id, id, len))
+			return entry.pNode;
+	}
+
+	return NULL;
+}
+
+HomieProperty *HomieIndex::FindProperty(const char *nodeId, size_t nodeLen, const char *propId, size_t propLen)
+{
+	if (!table.size())
+		return NULL;
+
+	uint32_t hash = HashProperty(nodeId, nodeLen, propId, propLen);
+	size_t mask = table.size() - 1;
+
+	for (size_t i = hash & mask; table[i].pNode; i = (i + 1) & mask)
+	{
+		const Entry &entry = table[i];
+		if (entry.hash == hash && entry.pProperty && Equals(entry.pNode->id, nodeId, nodeLen) && Equals(entry.pProperty->id, propId, propLen))
+			return entry.pProperty;
+	}
+
+	return NULL;
+}
+
+HomieProperty *HomieIndex::FindProperty(const char *path, size_t len)
+{
+	const char *slash = (const char *)memchr(path, '/', len);
+	if (!slash)
+		return NULL;
+
+	size_t nodeLen = slash - path;
+	return FindProperty(path, nodeLen, slash + 1, len - nodeLen - 1);
+}
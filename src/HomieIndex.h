@@ -0,0 +1,36 @@
+#pragma once
+#include "Arduino.h"
+
+#include <vector>
+
+class HomieNode;
+class HomieProperty;
+
+uint32_t HomieHash(const char *in, size_t len, uint32_t hash = 2166136261UL); //FNV-1a, pass a previous hash to continue it
+
+//Open addressing hash index of a device tree by node id and "node/property" path.
+//Entries point back into the tree and compare against its ids, so lookups don't allocate.
+class HomieIndex
+{
+public:
+	void Build(const std::vector<HomieNode *> &vecNode);
+	void Invalidate() { built = false; }
+	bool IsBuilt() { return built; }
+
+	HomieNode *FindNode(const char *id, size_t len);
+	HomieProperty *FindProperty(const char *nodeId, size_t nodeLen, const char *propId, size_t propLen);
+	HomieProperty *FindProperty(const char *path, size_t len); //"node/property"
+
+private:
+	struct Entry
+	{
+		uint32_t hash;
+		HomieNode *pNode;
+		HomieProperty *pProperty; //NULL for node entries
+	};
+
+	std::vector<Entry> table;
+	bool built = false;
+
+	void Insert(uint32_t hash, HomieNode *pNode, HomieProperty *pProperty);
+};
@@ -0,0 +1,84 @@
+#include "HomieLog.h"
+
+#include <atomic>
+#include <stdarg.h>
+
+static std::vector<HomieDebugPrintCallback> vecDebugPrint;
+
+static uint8_t logLevel = homieLogInfo;
+uint8_t homieLogActiveLevel = homieLogNone;
+
+static char *pRing = NULL;
+static size_t ringLines = 0;
+static size_t ringLineLength = 0;
+static std::atomic<uint32_t> ringNext(0);
+
+static void UpdateActiveLevel()
+{
+	homieLogActiveLevel = (vecDebugPrint.size() || pRing) ? logLevel : (uint8_t)homieLogNone;
+}
+
+void HomieLibRegisterDebugPrintCallback(HomieDebugPrintCallback cb)
+{
+	vecDebugPrint.push_back(cb);
+	UpdateActiveLevel();
+}
+
+void HomieLibSetLogLevel(eHomieLogLevel level)
+{
+	logLevel = level;
+	UpdateActiveLevel();
+}
+
+void HomieLibEnableLogRing(size_t lines, size_t lineLength)
+{
+	if (pRing || !lines || lineLength < 2)
+		return;
+
+	pRing = (char *)calloc(lines, lineLength);
+	if (!pRing)
+		return;
+
+	ringLines = lines;
+	ringLineLength = lineLength;
+	UpdateActiveLevel();
+}
+
+void HomieLibDumpLogRing(HomieDebugPrintCallback cb)
+{
+	if (!pRing)
+		return;
+
+	uint32_t end = ringNext.load();
+	uint32_t start = end > ringLines ? end - ringLines : 0;
+
+	for (uint32_t i = start; i != end; i++)
+	{
+		cb(pRing + (i % ringLines) * ringLineLength);
+	}
+}
+
+void HomieLogPrintf(eHomieLogLevel level, const char *szFormat, ...)
+{
+	if (!HomieLogEnabled(level))
+		return;
+
+	char szTemp[256];
+
+	va_list args;
+	va_start(args, szFormat);
+	vsnprintf(szTemp, sizeof(szTemp), szFormat, args);
+	va_end(args);
+
+	if (pRing)
+	{
+		char *pLine = pRing + (ringNext.fetch_add(1) % ringLines) * ringLineLength;
+		strncpy(pLine, szTemp, ringLineLength - 1);
+		pLine[ringLineLength - 1] = 0;
+	}
+
+	for (size_t i = 0; i < vecDebugPrint.size(); i++)
+	{
+		vecDebugPrint[i](szTemp);
+	}
+}
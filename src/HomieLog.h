@@ -0,0 +1,53 @@
+#pragma once
+#include "Arduino.h"
+
+#include <functional>
+
+//Leveled logging. A message is only formatted when its level passes both the compile time filter
+//(HOMIELIB_LOG_LEVEL, everything by default) and the runtime one, and something is listening.
+
+enum eHomieLogLevel
+{
+	homieLogNone,
+	homieLogError,
+	homieLogWarning,
+	homieLogInfo,
+	homieLogDebug,
+	homieLogVerbose,
+};
+
+#ifndef HOMIELIB_LOG_LEVEL
+#define HOMIELIB_LOG_LEVEL homieLogVerbose
+#endif
+
+typedef std::function<void(const char *szText)> HomieDebugPrintCallback;
+
+void HomieLibRegisterDebugPrintCallback(HomieDebugPrintCallback cb);
+void HomieLibSetLogLevel(eHomieLogLevel level); //runtime filter, homieLogInfo by default
+
+//Keep the last lines in a preallocated ring for post-mortem retrieval, also without a print callback.
+//Writers only take a slot with an atomic increment, so logging never blocks.
+void HomieLibEnableLogRing(size_t lines, size_t lineLength = 96);
+void HomieLibDumpLogRing(HomieDebugPrintCallback cb); //oldest line first
+
+extern uint8_t homieLogActiveLevel; //runtime level, or homieLogNone while nobody is listening
+
+inline bool HomieLogEnabled(eHomieLogLevel level)
+{
+	return level <= homieLogActiveLevel;
+}
+
+void HomieLogPrintf(eHomieLogLevel level, const char *szFormat, ...) __attribute__((format(printf, 2, 3)));
+
+#define HOMIE_LOG(level, ...)                                                  \
+	do                                                                         \
+	{                                                                          \
+		if ((level) <= HOMIELIB_LOG_LEVEL && HomieLogEnabled(level))           \
+			HomieLogPrintf(level, __VA_ARGS__);                                \
+	} while (0)
+
+#define HOMIE_LOGE(...) HOMIE_LOG(homieLogError, __VA_ARGS__)
+#define HOMIE_LOGW(...) HOMIE_LOG(homieLogWarning, __VA_ARGS__)
+#define HOMIE_LOGI(...) HOMIE_LOG(homieLogInfo, __VA_ARGS__)
+#define HOMIE_LOGD(...) HOMIE_LOG(homieLogDebug, __VA_ARGS__)
+#define HOMIE_LOGV(...) HOMIE_LOG(homieLogVerbose, __VA_ARGS__)
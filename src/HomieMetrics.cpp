@@ -0,0 +1,122 @@
+#include "HomieMetrics.h"
+
+#ifndef HOMIELIB_METRICS
+static const HomieHistogram emptyHistogram = {};
+#endif
+
+uint32_t HomieHistogram::GetPercentile(int percent) const
+{
+	if (!count)
+		return 0;
+
+	uint32_t target = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+	uint32_t seen = 0;
+	for (int i = 0; i < HOMIE_HISTOGRAM_BUCKETS - 1; i++)
+	{
+		seen += bucket[i];
+		if (seen >= target)
+		{
+			uint32_t bound = (1UL << i) - 1;
+			return bound < max ? bound : max;
+		}
+	}
+	return max;
+}
+
+HomieMetrics::HomieMetrics()
+{
+	Reset();
+}
+
+void HomieMetrics::Reset()
+{
+#ifdef HOMIELIB_METRICS
+	memset(counter, 0, sizeof(counter));
+	memset(histogram, 0, sizeof(histogram));
+#endif
+}
+
+void HomieMetrics::Increment(eHomieCounter counterIn, uint32_t amount)
+{
+#ifdef HOMIELIB_METRICS
+	counter[counterIn] += amount;
+#else
+	(void)counterIn;
+	(void)amount;
+#endif
+}
+
+void HomieMetrics::Record(eHomieHistogram histogramIn, uint32_t value)
+{
+#ifdef HOMIELIB_METRICS
+	HomieHistogram &h = histogram[histogramIn];
+
+	int i = 0;
+	while (i < HOMIE_HISTOGRAM_BUCKETS - 1 && value >= (1UL << i))
+		i++;
+
+	h.bucket[i]++;
+	h.count++;
+	if (value > h.max)
+		h.max = value;
+#else
+	(void)histogramIn;
+	(void)value;
+#endif
+}
+
+uint32_t HomieMetrics::GetCounter(eHomieCounter counterIn)
+{
+#ifdef HOMIELIB_METRICS
+	return counter[counterIn];
+#else
+	(void)counterIn;
+	return 0;
+#endif
+}
+
+const HomieHistogram &HomieMetrics::GetHistogram(eHomieHistogram histogramIn)
+{
+#ifdef HOMIELIB_METRICS
+	return histogram[histogramIn];
+#else
+	(void)histogramIn;
+	return emptyHistogram;
+#endif
+}
+
+const char *HomieMetrics::GetCounterName(eHomieCounter counterIn)
+{
+	switch (counterIn)
+	{
+	default:
+		return "invalid";
+	case homieCounterPublish:
+		return "publishes";
+	case homieCounterPublishFailed:
+		return "publish-failures";
+	case homieCounterDispatchMiss:
+		return "dispatch-misses";
+	case homieCounterRejectedPayload:
+		return "rejected-payloads";
+	case homieCounterReconnect:
+		return "reconnects";
+	case homieCounterEchoDropped:
+		return "echoes-dropped";
+	case homieCounterPublishDeferred:
+		return "publishes-deferred";
+	}
+}
+
+const char *HomieMetrics::GetHistogramName(eHomieHistogram histogramIn)
+{
+	switch (histogramIn)
+	{
+	default:
+		return "invalid";
+	case homieHistogramLoop_us:
+		return "loop-us";
+	case homieHistogramTimeToReady_ms:
+		return "time-to-ready-ms";
+	}
+}
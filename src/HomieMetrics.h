@@ -0,0 +1,68 @@
+#pragma once
+#include "Arduino.h"
+
+//Runtime metrics for a HomieDevice. Define HOMIELIB_NO_METRICS to compile them out, the API then reads zeros.
+#ifndef HOMIELIB_NO_METRICS
+#define HOMIELIB_METRICS
+#endif
+
+enum eHomieCounter
+{
+	homieCounterPublish,		  //successful publishes
+	homieCounterPublishFailed,	  //publishes the client refused
+	homieCounterDispatchMiss,	  //messages received for our topics that nothing is registered for
+	homieCounterRejectedPayload,  //values refused as invalid or incomplete
+	homieCounterReconnect,		  //connections established
+	homieCounterEchoDropped,	  //our own publishes received back on a subscribed base topic
+	homieCounterPublishDeferred,  //property publishes queued in a lane instead of sent right away
+	homieCounterCount,
+};
+
+enum eHomieHistogram
+{
+	homieHistogramLoop_us,		  //time spent in HomieDevice::Loop
+	homieHistogramTimeToReady_ms, //connect to $state=ready
+	homieHistogramCount,
+};
+
+#define HOMIE_HISTOGRAM_BUCKETS 24 //bucket i counts values below 2^i, the last one everything bigger
+
+struct HomieHistogram
+{
+	uint32_t bucket[HOMIE_HISTOGRAM_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+
+	uint32_t GetPercentile(int percent) const; //upper bound of the bucket the percentile falls into
+};
+
+class HomieMetrics
+{
+public:
+	HomieMetrics();
+
+	void Increment(eHomieCounter counter, uint32_t amount = 1);
+	void Record(eHomieHistogram histogram, uint32_t value);
+	void Reset();
+
+	uint32_t GetCounter(eHomieCounter counter);
+	const HomieHistogram &GetHistogram(eHomieHistogram histogram);
+
+	//names used for $stats/<name>, histograms publish <name>-p50 and <name>-p99
+	static const char *GetCounterName(eHomieCounter counter);
+	static const char *GetHistogramName(eHomieHistogram histogram);
+
+private:
+#ifdef HOMIELIB_METRICS
+	uint32_t counter[homieCounterCount];
+	HomieHistogram histogram[homieHistogramCount];
+#endif
+};
+
+#ifdef HOMIELIB_METRICS
+#define HOMIE_METRIC_INC(metrics, counter) (metrics).Increment(counter)
+#define HOMIE_METRIC_RECORD(metrics, histogram, value) (metrics).Record(histogram, value)
+#else
+#define HOMIE_METRIC_INC(metrics, counter)
+#define HOMIE_METRIC_RECORD(metrics, histogram, value)
+#endif
@@ -1,9 +1,11 @@
 #include "HomieNode.h"
 #include "HomieDevice.h"
+#include "HomieNumeric.h"
+#include "HomieAlloc.h"
+#include "HomieIndex.h"
 
-void HomieLibDebugPrint(const char * szText);
-
-#define csprintf(...) { char szTemp[256]; sprintf(szTemp,__VA_ARGS__ ); HomieLibDebugPrint(szTemp); }
+const unsigned long echoWindow_ms = 10000; //how long after a publish the same payload on the base topic counts as its echo
+static_assert(HOMIELIB_ECHO_SLOTS>0 && HOMIELIB_ECHO_SLOTS<=8,"echoUsed keeps a bit per slot in a uint8_t");
 
 const char * GetHomieDataTypeText(eHomieDataType datatype)
 {
@@ -23,9 +25,27 @@ const char * GetHomieDataTypeText(eHomieDataType datatype)
 		return "enum";
 	case homieColor:
 		return "color";
+	case homieBinary:
+		return "string"; //not a homie 3.0.1 type, $format carries the layout
 	}
 };
 
+bool HomieParseDataType(const char * szText, size_t len, eHomieDataType & datatype)
+{
+	static const eHomieDataType types[]={homieString,homieInt,homieFloat,homieBool,homieEnum,homieColor};
+
+	for(size_t i=0;i<sizeof(types)/sizeof(types[0]);i++)
+	{
+		const char * szType=GetHomieDataTypeText(types[i]);
+		if(strlen(szType)==len && !memcmp(szType,szText,len))
+		{
+			datatype=types[i];
+			return true;
+		}
+	}
+	return false;
+}
+
 const char * GetDefaultForHomieDataType(eHomieDataType datatype)
 {
 	switch(datatype)
@@ -33,6 +53,7 @@ const char * GetDefaultForHomieDataType(eHomieDataType datatype)
 	default:
 		return "uninitialized";
 	case homieString:
+	case homieBinary:
 		return "";
 	case homieInt:
 		return "0";
@@ -50,12 +71,60 @@ bool HomieDataTypeAllowsEmpty(eHomieDataType datatype)
 	switch(datatype)
 	{
 	case homieString:
+	case homieBinary:
+		return true;
+	default:
+		return false;
+	}
+};
+
+bool HomieDataTypeAllowsArray(eHomieDataType datatype)
+{
+	switch(datatype)
+	{
+	case homieInt:
+	case homieFloat:
+	case homieBool:
+	case homieEnum:
+	case homieColor:
 		return true;
 	default:
 		return false;
 	}
 };
 
+size_t GetHomieBinaryElementSize(eHomieBinaryLayout layout)
+{
+	switch(layout)
+	{
+	default:
+	case homieBinaryInt16:
+		return 2;
+	case homieBinaryInt32:
+	case homieBinaryFloat32:
+		return 4;
+	}
+}
+
+static const char * GetHomieBinaryLayoutText(eHomieBinaryLayout layout)
+{
+	switch(layout)
+	{
+	default:
+	case homieBinaryInt16:
+		return "int16le";
+	case homieBinaryInt32:
+		return "int32le";
+	case homieBinaryFloat32:
+		return "float32le";
+	}
+}
+
+//the esp8266 and esp32 are little-endian, so buffers go out as they are
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "homieBinary properties assume a little-endian target"
+#endif
+
 
 HomieProperty::HomieProperty()
 {
@@ -70,16 +139,32 @@ void HomieProperty::SetStandardMQTT(const String & strMqttTopic)
 	retained=false;
 	settable=true;
 	topic=strMqttTopic;
-	setTopic="";
 
 }
 
 void HomieProperty::Init()
 {
-	if(!standardMQTT)
+	//no topics here, they are built when used (GetTopic)
+	if(parent->IsArray())
+	{
+		if(!HomieDataTypeAllowsArray(datatype))
+		{
+			HOMIE_LOGE("%s/%s: %s properties can't be in an $array node, left out\n",parent->id.c_str(),id.c_str(),datatype==homieBinary?"binary":GetHomieDataTypeText(datatype));
+			return;
+		}
+		GetArraySlot(0); //size the value array up front
+	}
+	else if(datatype==homieBinary)
+	{
+		size_t bytes=binaryCount*GetHomieBinaryElementSize(binaryLayout);
+		if(!bytes && parent->parent->bStaticMemory) bytes=valueCapacity?valueCapacity:HOMIELIB_STRING_CAPACITY;
+		if(!valueCapacity) valueCapacity=bytes;
+		binaryValue.reserve((bytes+3)/4);
+	}
+	else if(parent->parent->bStaticMemory)
 	{
-		topic=parent->topic+"/"+id;
-		setTopic=topic+"/set";
+		if(!valueCapacity) valueCapacity=GetDefaultValueCapacity();
+		value.reserve(valueCapacity>value.length()?valueCapacity:value.length());
 	}
 	initialized=true;
 }
@@ -95,6 +180,7 @@ void HomieProperty::DoCallback()
 
 void HomieProperty::AddCallback(HomiePropertyCallback cb)
 {
+	HOMIE_ALLOC_SCOPE(homieAllocTree);
 	callback.push_back(cb);
 }
 
@@ -105,15 +191,14 @@ const String & HomieProperty::GetValue()
 
 void HomieProperty::PublishDefault()
 {
-	if(settable && retained && !receivedRetained && !standardMQTT)
+	if(settable && retained && !receivedRetained && !standardMQTT && !parent->IsArray())
 	{
 		receivedRetained=true;
-		if(value.length())
+		if(value.length() || externalValue || binaryLength)
 		{
-#ifdef HOMIELIB_VERBOSE
-			csprintf("%s didn't receive initial value for base topic %s so unsubscribe and publish default.\n",friendlyName.c_str(),topic.c_str());
-#endif
-			parent->parent->mqtt.unsubscribe(topic.c_str());
+			char szTopic[HOMIELIB_TOPIC_BUFFER];
+			HOMIE_LOGV("%s didn't receive initial value for base topic %s so unsubscribe and publish default.\n",friendlyName.c_str(),GetTopic(szTopic,sizeof(szTopic)));
+			parent->parent->Mqtt().unsubscribe(szTopic);
 			Publish();
 		}
 	}
@@ -124,218 +209,766 @@ bool HomieProperty::Publish()
 {
 	if(!initialized) return false;
 	if(standardMQTT) return false;
+	if(parent->IsArray()) return false;
 
-	bool bRet=false;
-	String strPublish=value;
+	HomieDevice * pDevice=parent->parent;
+	if(!lanePending && !pDevice->IsLaneBusy(lane) && PublishValue()) return true;
+	if(!pDevice->IsConnected()) return false; //initial publishing sends the value after connecting
+
+	//behind a more urgent publish, or refused by the client. It goes out with the latest value when its turn comes.
+	pDevice->QueuePublish(this);
+	return true;
+}
+
+bool HomieProperty::PublishValue()
+{
+	if(externalValue) return PublishSpan(externalValue,externalLength);
+	if(datatype==homieBinary) return binaryLength?PublishSpan((const char *)binaryValue.data(),binaryLength):true;
+
+	const char * szPublish=value.c_str();
+	size_t len=value.length();
 
-	if(!strPublish.length() && !publishEmptyString) return true;
+	if(!len && !publishEmptyString) return true;
 
-	if(!strPublish.length() && !HomieDataTypeAllowsEmpty(datatype))
+	if(!len && !HomieDataTypeAllowsEmpty(datatype))
 	{
-		strPublish=GetDefaultForHomieDataType(datatype);
-#ifdef HOMIELIB_VERBOSE
-		csprintf("Empty value for %s encountered, substituting default. ",id.c_str());
-#endif
+		szPublish=GetDefaultForHomieDataType(datatype);
+		len=strlen(szPublish);
+		HOMIE_LOGV("Empty value for %s encountered, substituting default. ",id.c_str());
 	}
 
-	if(!parent->parent->mqtt.connected())
+	return PublishSpan(szPublish,len);
+}
+
+bool HomieProperty::PublishSpan(const char * payload, size_t length)
+{
+	if(!initialized) return false;
+	if(standardMQTT) return false;
+
+	bool bRet=false;
+
+	//payloads can be large and aren't necessarily terminated, so only log the start
+	int logLength=length>64?64:(int)length;
+
+	if(!parent->parent->IsConnected())
 	{
-#ifdef HOMIELIB_VERBOSE
-		csprintf("%s can't publish \"%s\" because not connected\n",friendlyName.c_str(),strPublish.c_str());
-#endif
+		if(datatype==homieBinary) HOMIE_LOGV("%s can't publish %u bytes because not connected\n",friendlyName.c_str(),(unsigned int)length);
+		else HOMIE_LOGV("%s can't publish \"%.*s\" because not connected\n",friendlyName.c_str(),logLength,payload);
 	}
 	else
 	{
-#ifdef HOMIELIB_VERBOSE
-		csprintf("%s publishing \"%s\"\n",friendlyName.c_str(),strPublish.c_str());
-#endif
-		bRet=0!=parent->parent->mqtt.publish(topic.c_str(), 2, retained, strPublish.c_str(), strPublish.length());
+		if(datatype==homieBinary) HOMIE_LOGV("%s publishing %u bytes\n",friendlyName.c_str(),(unsigned int)length);
+		else HOMIE_LOGV("%s publishing \"%.*s\"%s\n",friendlyName.c_str(),logLength,payload,(int)length>logLength?"...":"");
+		char szTopic[HOMIELIB_TOPIC_BUFFER];
+		uint16_t messageId=*GetTopic(szTopic,sizeof(szTopic))?parent->parent->Mqtt().publish(szTopic, 2, retained, payload, length):0;
+		bRet=0!=messageId;
+		if(bRet) lastPublishTimestamp=millis();
+		HomieTopicAliases & aliases=parent->parent->TopicAliases();
+		if(bRet && aliases.bEnabled)
+		{
+			//AsyncMqttClient only speaks 3.1.1 and has no way to send the alias, so the topic always goes out in full
+			bool bSendTopic;
+			aliases.OnPublish(this,strlen(szTopic),bSendTopic);
+		}
+		if(bRet && settable && retained && !receivedRetained) RememberEcho(payload,length);
+		HOMIE_METRIC_INC(parent->parent->metrics,bRet?homieCounterPublish:homieCounterPublishFailed);
 	}
 	return bRet;
 }
 
+bool HomieProperty::AssignValue(const char * szNewValue, size_t len)
+{
+	//compare the normalized text in place, no copy of the old value needed
+	valueChanged=value.length()!=len || memcmp(value.c_str(),szNewValue,len);
+	if(!valueChanged) return true;
+
+	if(parent->parent->bStaticMemory && len>valueCapacity)
+	{
+		HOMIE_LOGW("%s ignoring value of %i bytes (capacity %i)\n",friendlyName.c_str(),(int)len,(int)valueCapacity);
+		valueChanged=false;
+		return false;
+	}
+
+	//assigning in place keeps the reserved buffer
+	value="";
+	value.concat(szNewValue,len);
+	return true;
+}
+
+size_t HomieProperty::GetDefaultValueCapacity()
+{
+	switch(datatype)
+	{
+	default:
+		return HOMIELIB_STRING_CAPACITY;
+	case homieInt:
+	case homieFloat:
+	case homieColor:
+		return HOMIE_NUMERIC_BUFFER-1;
+	case homieBool:
+		return 5;
+	case homieEnum:
+		{
+			size_t longest=0;
+			const char * szOption=strFormat.c_str();
+			while(szOption)
+			{
+				const char * szComma=strchr(szOption,',');
+				size_t len=szComma?(size_t)(szComma-szOption):strlen(szOption);
+				if(len>longest) longest=len;
+				szOption=szComma?szComma+1:NULL;
+			}
+			return longest;
+		}
+	}
+}
+
+bool HomieProperty::ShouldPublish(bool bChanged)
+{
+	switch(publishMode)
+	{
+	default:
+	case homiePublishAlways:
+		return true;
+	case homiePublishOnChange:
+		return bChanged;
+	case homiePublishOnChangeOrHeartbeat:
+		return bChanged || (millis()-lastPublishTimestamp)>=heartbeat_ms;
+	}
+}
+
+void HomieProperty::PublishHeartbeat()
+{
+	if(publishMode!=homiePublishOnChangeOrHeartbeat || (millis()-lastPublishTimestamp)<heartbeat_ms) return;
+
+	if(parent->IsArray())
+	{
+		//Publish() doesn't cover instances. A batch per call, after anything waiting in the lanes, so a big array
+		//doesn't go out in one burst. The round ends, and the next one is timed, once the last instance went out.
+		if(parent->parent->IsLaneBusy(homieLaneStats)) return;
+
+		uint16_t count=parent->GetArraySize();
+		for(int sent=0;sent<HOMIELIB_ARRAY_HEARTBEAT_BATCH && heartbeatIndex<count;sent++)
+		{
+			if(!PublishArray(heartbeatIndex)) return; //this one again next time
+			heartbeatIndex++;
+		}
+		if(heartbeatIndex>=count)
+		{
+			heartbeatIndex=0;
+			lastPublishTimestamp=millis();
+		}
+		return;
+	}
+
+	//the controller's retained value goes first, our default only after restore or PublishDefault
+	if(settable && retained && !receivedRetained) return;
+
+	Publish();
+}
+
+void HomieProperty::SetValueExternal(const char * payload, size_t length)
+{
+	HOMIE_ALLOC_SCOPE(homieAllocPublish);
+	externalValue=payload;
+	externalLength=length;
+	value="";
+	Publish();
+}
 
 void HomieProperty::SetValue(const String & strNewValue)
 {
-	if(SetValueConstrained(strNewValue))
+	SetValueSpan(strNewValue.c_str(),strNewValue.length());
+}
+
+void HomieProperty::SetValue(const char * szNewValue)
+{
+	SetValueSpan(szNewValue,strlen(szNewValue));
+}
+
+void HomieProperty::SetValueSpan(const char * szNewValue, size_t len)
+{
+	if(parent->parent->ShouldQueueValues())
 	{
-		Publish();
+		QueueValue(szNewValue,len);
+		return;
+	}
+
+	HOMIE_ALLOC_SCOPE(homieAllocPublish);
+	if(SetValueConstrained(szNewValue,len))
+	{
+		bool bChanged=valueChanged || externalValue;
+		externalValue=NULL;
+		if(ShouldPublish(bChanged)) Publish(); else suppressedPublishes++;
 	}
 }
 
 void HomieProperty::SetBool(bool bValue)
 {
-	String strTemp=bValue?"true":"false";
-	SetValue(strTemp);
+	SetValue(bValue?"true":"false");
+}
+
+void HomieProperty::SetInt(int32_t iValue)
+{
+	char szTemp[HOMIE_NUMERIC_BUFFER];
+	HomieFormatInt(szTemp,sizeof(szTemp),iValue);
+	SetValue(szTemp);
+}
+
+void HomieProperty::SetFloat(double fValue)
+{
+	char szTemp[HOMIE_NUMERIC_BUFFER];
+	if(!HomieFormatFloat(szTemp,sizeof(szTemp),fValue,precision)) return;
+	SetValue(szTemp);
+}
+
+
+void HomieProperty::SetBinaryLayout(eHomieBinaryLayout layout, uint16_t count)
+{
+	if(initialized) return;
+
+	datatype=homieBinary;
+	binaryLayout=layout;
+	binaryCount=count;
+
+	char szFormat[32];
+	if(count) snprintf(szFormat,sizeof(szFormat),"binary:%s[%u]",GetHomieBinaryLayoutText(layout),count);
+	else snprintf(szFormat,sizeof(szFormat),"binary:%s[]",GetHomieBinaryLayoutText(layout));
+	strFormat=szFormat;
+}
+
+bool HomieProperty::PublishBinary(const void * data, uint16_t count)
+{
+	HOMIE_ALLOC_SCOPE(homieAllocPublish);
+
+	if(datatype!=homieBinary) return false;
+
+	const char * payload=(const char *)data;
+	size_t len=count*GetHomieBinaryElementSize(binaryLayout);
+
+	if(retained)
+	{
+		if(!AssignBinary(payload,len)) return false;
+		externalValue=NULL;
+		if(!ShouldPublish(valueChanged))
+		{
+			suppressedPublishes++;
+			return true;
+		}
+	}
+	else if(binaryCount && count!=binaryCount)
+	{
+		HOMIE_LOGW("%s ignoring %u elements (layout has %u)\n",friendlyName.c_str(),count,binaryCount);
+		return false;
+	}
+
+	return PublishSpan(payload,len);
 }
 
+bool HomieProperty::AssignBinary(const char * payload, size_t len)
+{
+	size_t elementSize=GetHomieBinaryElementSize(binaryLayout);
+
+	if(len%elementSize || (binaryCount && len!=binaryCount*elementSize))
+	{
+		HOMIE_LOGW("%s ignoring %u byte payload (not a %s)\n",friendlyName.c_str(),(unsigned int)len,strFormat.c_str());
+		return false;
+	}
+
+	valueChanged=len!=binaryLength || (len && memcmp(binaryValue.data(),payload,len));
+	if(!valueChanged) return true;
+
+	size_t words=(len+3)/4;
+	if(parent->parent->bStaticMemory && len>valueCapacity)
+	{
+		HOMIE_LOGW("%s ignoring value of %i bytes (capacity %i)\n",friendlyName.c_str(),(int)len,(int)valueCapacity);
+		valueChanged=false;
+		return false;
+	}
+
+	if(binaryValue.size()<words) binaryValue.resize(words);
+	memcpy(binaryValue.data(),payload,len);
+	binaryLength=len;
+	return true;
+}
 
-bool HomieProperty::ValidateFormat_Int(int & min, int & max)
+static int EnumIndex(const String & strFormat, const char * szValue, size_t len)
+{
+	const char * szOption=strFormat.c_str();
+
+	for(int index=0;;index++)
+	{
+		const char * szComma=strchr(szOption,',');
+		size_t optionLen=szComma?(size_t)(szComma-szOption):strlen(szOption);
+		if(optionLen==len && !strncmp(szOption,szValue,len)) return index;
+		if(!szComma) return -1;
+		szOption=szComma+1;
+	}
+}
+
+static void FormatTriplet(char * szOut, size_t size, int32_t a, int32_t b, int32_t c)
+{
+	size_t len=HomieFormatInt(szOut,size,a);
+	szOut[len++]=',';
+	len+=HomieFormatInt(szOut+len,size-len,b);
+	szOut[len++]=',';
+	HomieFormatInt(szOut+len,size-len,c);
+}
+
+static bool ValidateFormat_Int(const String & strFormat, int32_t & min, int32_t & max)
 {
 	int colon=strFormat.indexOf(':');
 
 	if(colon>0)
 	{
-		min=atoi(strFormat.substring(0, colon).c_str());
-		max=atoi(strFormat.substring(colon+1).c_str());
-		return true;
+		const char * szFormat=strFormat.c_str();
+		return HomieParseInt(szFormat,colon,min) && HomieParseInt(szFormat+colon+1,strFormat.length()-colon-1,max);
 	}
 
 	return false;
 }
 
-bool HomieProperty::ValidateFormat_Double(double & min, double & max)
+static bool ValidateFormat_Double(const String & strFormat, double & min, double & max)
 {
 	int colon=strFormat.indexOf(':');
 
 	if(colon>0)
 	{
-		min=atof(strFormat.substring(0, colon).c_str());
-		max=atof(strFormat.substring(colon+1).c_str());
-		return true;
+		const char * szFormat=strFormat.c_str();
+		return HomieParseFloat(szFormat,colon,min) && HomieParseFloat(szFormat+colon+1,strFormat.length()-colon-1,max);
 	}
 
 	return false;
 }
 
+//within $format, logs why not
+static bool ParseInt(const String & strFormat, const char * szName, const char * szNewValue, size_t len, int32_t & value)
+{
+	if(!HomieParseInt(szNewValue,len,value))
+	{
+		HOMIE_LOGW("%s ignoring invalid payload %.*s (not an integer)\n",szName,(int)len,szNewValue);
+		return false;
+	}
+
+	int32_t min,max;
+
+	if(ValidateFormat_Int(strFormat,min,max))
+	{
+		if(value<min || value>max)
+		{
+			HOMIE_LOGW("%s ignoring invalid payload %.*s (int out of range %i:%i)\n",szName,(int)len,szNewValue,(int)min,(int)max);
+			return false;
+		}
+	}
+
+	return true;
+}
 
-bool HomieProperty::SetValueConstrained(const String & strNewValue)
+static bool ParseFloat(const String & strFormat, const char * szName, const char * szNewValue, size_t len, double & value)
 {
-	switch(datatype)
+	if(!HomieParseFloat(szNewValue,len,value))
 	{
-	default:
-		value=strNewValue;
-		return true;
-	case homieInt:
+		HOMIE_LOGW("%s ignoring invalid payload %.*s (not a float)\n",szName,(int)len,szNewValue);
+		return false;
+	}
+
+	double min,max;
+
+	if(ValidateFormat_Double(strFormat,min,max))
+	{
+		if(value<min || value>max)
 		{
+			HOMIE_LOGW("%s ignoring invalid payload %.*s (float out of range %.04f:%.04f)\n",szName,(int)len,szNewValue,min,max);
+			return false;
+		}
+	}
 
-			int newvalue=atoi(strNewValue.c_str());
+	return true;
+}
 
-			int min,max;
+static bool ParseColor(const String & strFormat, const char * szName, const char * szNewValue, size_t len, int32_t c[3])
+{
+	bool bHSV=strFormat=="hsv";
+	int32_t max0=bHSV?360:255;
+	int32_t max12=bHSV?100:255;
 
-			if(ValidateFormat_Int(min,max))
-			{
-				if(newvalue<min || newvalue>max)
-				{
-#ifdef HOMIELIB_VERBOSE
-					csprintf("%s ignoring invalid payload %s (int out of range %i:%i)\n",friendlyName.c_str(),strNewValue.c_str(),min,max);
-#endif
-					return false;
-				}
-			}
+	if(!HomieParseTriplet(szNewValue,len,c) || c[0]<0 || c[0]>max0 || c[1]<0 || c[1]>max12 || c[2]<0 || c[2]>max12)
+	{
+		HOMIE_LOGW("%s ignoring invalid payload %.*s (not a valid %s color)\n",szName,(int)len,szNewValue,bHSV?"hsv":"rgb");
+		return false;
+	}
 
-			value=String(newvalue);
-			return true;
+	return true;
+}
+
+const char * HomieConstrainPayload(eHomieDataType datatype, const String & strFormat, int precision, const char * szName, const char * payload, size_t & len, char * szTemp, size_t size)
+{
+	switch(datatype)
+	{
+	default:
+		return payload;
+	case homieInt:
+		{
+			int32_t value;
+			if(!ParseInt(strFormat,szName,payload,len,value)) return NULL;
+
+			len=HomieFormatInt(szTemp,size,value);
+			return len?szTemp:NULL;
 		}
-		break;
 	case homieFloat:
 		{
-			double newvalue=atof(strNewValue.c_str());
+			double value;
+			if(!ParseFloat(strFormat,szName,payload,len,value)) return NULL;
 
-			double min,max;
-
-			if(ValidateFormat_Double(min,max))
-			{
-				if(newvalue<min || newvalue>max)
-				{
-#ifdef HOMIELIB_VERBOSE
-					csprintf("%s ignoring invalid payload %s (float out of range %.04f:%.04f)\n",friendlyName.c_str(),strNewValue.c_str(),min,max);
-#endif
-					return false;
-				}
-			}
-
-			value=String(newvalue);
-			return true;
+			len=HomieFormatFloat(szTemp,size,value,precision);
+			return len?szTemp:NULL;
 		}
 	case homieBool:
-		if(strNewValue=="true") value="true"; else if(strNewValue=="false") value="false";
-		else
+		if((len==4 && !memcmp(payload,"true",4)) || (len==5 && !memcmp(payload,"false",5))) return payload;
+		HOMIE_LOGW("%s ignoring invalid payload %.*s (bool needs true or false)\n",szName,(int)len,payload);
+		return NULL;
+	case homieEnum:
+		if(EnumIndex(strFormat,payload,len)<0)
 		{
-#ifdef HOMIELIB_VERBOSE
-			csprintf("%s ignoring invalid payload %s (bool needs true or false)\n",friendlyName.c_str(),strNewValue.c_str());
-#endif
-			return false;
+			HOMIE_LOGW("%s ignoring invalid payload %.*s (not one of %s)\n",szName,(int)len,payload,strFormat.c_str());
+			return NULL;
 		}
-		return true;
-	case homieEnum:
+		return payload;
+	case homieColor:
 		{
-			int start=0;
-			int comma;
+			int32_t c[3];
+			if(!ParseColor(strFormat,szName,payload,len,c)) return NULL;
 
-			bool bValid=false;
+			FormatTriplet(szTemp,size,c[0],c[1],c[2]);
+			len=strlen(szTemp);
+			return szTemp;
+		}
+	};
+}
 
-			while((comma=strFormat.indexOf(',',start))>0)
-			{
-				if(strNewValue==strFormat.substring(start, comma))
-				{
-					bValid=true;
-					break;
-				}
-				start=comma+1;
-			}
+uint32_t HomieProperty::GetRGB()
+{
+	return colorRGB;
+}
 
-			if(!bValid)
-			{
-				if(strNewValue==strFormat.substring(start)) bValid=true;
-			}
+HomieHSV HomieProperty::GetHSV()
+{
+	return colorHSV;
+}
 
-			if(bValid)
-			{
-				value=strNewValue;
-				return true;
-			}
-			else
+void HomieProperty::SetRGB(uint32_t rgb)
+{
+	char szTemp[HOMIE_NUMERIC_BUFFER];
+	if(strFormat=="hsv")
+	{
+		HomieHSV hsv=HomieRGBtoHSV(rgb);
+		FormatTriplet(szTemp,sizeof(szTemp),hsv.h,hsv.s,hsv.v);
+	}
+	else
+	{
+		FormatTriplet(szTemp,sizeof(szTemp),(rgb>>16)&0xFF,(rgb>>8)&0xFF,rgb&0xFF);
+	}
+	SetValue(szTemp);
+}
+
+void HomieProperty::SetHSV(const HomieHSV & hsv)
+{
+	if(strFormat=="hsv")
+	{
+		char szTemp[HOMIE_NUMERIC_BUFFER];
+		FormatTriplet(szTemp,sizeof(szTemp),hsv.h,hsv.s,hsv.v);
+		SetValue(szTemp);
+	}
+	else
+	{
+		SetRGB(HomieHSVtoRGB(hsv.h,hsv.s,hsv.v));
+	}
+}
+
+HomieArraySlot * HomieProperty::GetArraySlot(uint16_t index)
+{
+	if(arrayValue.size()!=parent->arraySize)
+	{
+		HomieArraySlot zero;
+		zero.i=0;
+		arrayValue.assign(parent->arraySize,zero);
+	}
+
+	if(index>=arrayValue.size()) return NULL;
+	return &arrayValue[index];
+}
+
+int32_t HomieProperty::GetArrayInt(uint16_t index)
+{
+	HomieArraySlot * pSlot=GetArraySlot(index);
+	if(!pSlot) return 0;
+	return datatype==homieFloat?(int32_t)pSlot->f:pSlot->i;
+}
+
+double HomieProperty::GetArrayFloat(uint16_t index)
+{
+	HomieArraySlot * pSlot=GetArraySlot(index);
+	if(!pSlot) return 0;
+	return datatype==homieFloat?pSlot->f:pSlot->i;
+}
+
+void HomieProperty::SetArrayInt(uint16_t index, int32_t iValue)
+{
+	HomieArraySlot * pSlot=GetArraySlot(index);
+	if(!pSlot) return;
+	HomieArraySlot old=*pSlot;
+	if(datatype==homieFloat) pSlot->f=(float)iValue; else pSlot->i=iValue;
+	if(publishMode!=homiePublishAlways && IsSameArraySlot(old,*pSlot))
+	{
+		suppressedPublishes++;
+		return;
+	}
+	PublishArray(index);
+}
+
+void HomieProperty::SetArrayFloat(uint16_t index, double fValue)
+{
+	HomieArraySlot * pSlot=GetArraySlot(index);
+	if(!pSlot) return;
+	HomieArraySlot old=*pSlot;
+	if(datatype==homieFloat) pSlot->f=(float)fValue; else pSlot->i=(int32_t)fValue;
+	if(publishMode!=homiePublishAlways && IsSameArraySlot(old,*pSlot))
+	{
+		suppressedPublishes++;
+		return;
+	}
+	PublishArray(index);
+}
+
+bool HomieProperty::IsSameArraySlot(const HomieArraySlot & a, const HomieArraySlot & b)
+{
+	//floats by value, so 0 and -0 are the same and a NaN doesn't count as a change every time
+	if(datatype==homieFloat) return a.f==b.f || (isnan(a.f) && isnan(b.f));
+	return a.i==b.i;
+}
+
+size_t HomieProperty::FormatArraySlot(uint16_t index, char * szOut, size_t size)
+{
+	HomieArraySlot * pSlot=GetArraySlot(index);
+	if(!pSlot) return 0;
+
+	switch(datatype)
+	{
+	default:
+		return HomieFormatInt(szOut,size,pSlot->i);
+	case homieFloat:
+		return HomieFormatFloat(szOut,size,pSlot->f,precision);
+	case homieBool:
+		return snprintf(szOut,size,"%s",pSlot->i?"true":"false");
+	case homieColor:
+		if(strFormat=="hsv")
+		{
+			FormatTriplet(szOut,size,(pSlot->i>>16)&0xFFF,(pSlot->i>>8)&0xFF,pSlot->i&0xFF);
+		}
+		else
+		{
+			FormatTriplet(szOut,size,(pSlot->i>>16)&0xFF,(pSlot->i>>8)&0xFF,pSlot->i&0xFF);
+		}
+		return strlen(szOut);
+	case homieEnum:
+		{
+			const char * szOption=strFormat.c_str();
+			for(int32_t a=0;a<pSlot->i && szOption;a++)
 			{
-#ifdef HOMIELIB_VERBOSE
-				csprintf("%s ignoring invalid payload %s (not one of %s)\n",friendlyName.c_str(),strNewValue.c_str(),strFormat.c_str());
-#endif
-				return false;
+				szOption=strchr(szOption,',');
+				if(szOption) szOption++;
 			}
+			if(!szOption) return 0;
+			const char * szComma=strchr(szOption,',');
+			size_t len=szComma?(size_t)(szComma-szOption):strlen(szOption);
+			if(len>=size) return 0;
+			memcpy(szOut,szOption,len);
+			szOut[len]=0;
+			return len;
 		}
+	}
+}
+
+bool HomieProperty::PublishArray(uint16_t index)
+{
+	HOMIE_ALLOC_SCOPE(homieAllocPublish);
+	if(!initialized) return false;
+	if(!parent->parent->IsConnected()) return false;
+
+	char szValue[64];
+	size_t len=FormatArraySlot(index,szValue,sizeof(szValue));
+	if(!len) return false;
+
+	//derive the instance topic on demand rather than storing one per index
+	char szTopic[HOMIELIB_TOPIC_BUFFER];
+	int topicLen=snprintf(szTopic,sizeof(szTopic),"%s/%s_%u/%s",parent->parent->topic.c_str(),parent->id.c_str(),index,id.c_str());
+	if(topicLen<0 || (size_t)topicLen>=sizeof(szTopic))
+	{
+		HOMIE_LOGE("Topic of %s/%s doesn't fit in %u bytes\n",parent->id.c_str(),id.c_str(),(unsigned int)sizeof(szTopic));
+		return false;
+	}
 
+	bool bRet=0!=parent->parent->Mqtt().publish(szTopic, 2, retained, szValue, len);
+	HOMIE_METRIC_INC(parent->parent->metrics,bRet?homieCounterPublish:homieCounterPublishFailed);
+	return bRet;
+}
+
+void HomieProperty::OnArrayMessage(uint16_t index, const char * payload, size_t len)
+{
+	if(!initialized) return;
+	HomieArraySlot * pSlot=GetArraySlot(index);
+	if(!pSlot) return;
+
+	//parse straight into the slot, the scalar value isn't used by array properties
+	HomieArraySlot parsed;
+	bool bValid=true;
+
+	switch(datatype)
+	{
+	default:
+		bValid=ParseInt(strFormat,friendlyName.c_str(),payload,len,parsed.i);
+		break;
+	case homieFloat:
+		{
+			double fValue;
+			bValid=ParseFloat(strFormat,friendlyName.c_str(),payload,len,fValue);
+			parsed.f=(float)fValue;
+		}
+		break;
+	case homieBool:
+		if(len==4 && !memcmp(payload,"true",4)) parsed.i=1;
+		else if(len==5 && !memcmp(payload,"false",5)) parsed.i=0;
+		else
+		{
+			HOMIE_LOGW("%s ignoring invalid payload %.*s (bool needs true or false)\n",friendlyName.c_str(),(int)len,payload);
+			bValid=false;
+		}
 		break;
 	case homieColor:
-		value=strNewValue;
-		return true;
+		{
+			int32_t c[3];
+			bValid=ParseColor(strFormat,friendlyName.c_str(),payload,len,c);
+			//hsv stays hsv, converting to RGB and back would change hue and saturation
+			if(bValid) parsed.i=(c[0]<<16)+(c[1]<<8)+(c[2]<<0);
+		}
 		break;
-	};
+	case homieEnum:
+		parsed.i=EnumIndex(strFormat,payload,len);
+		if(parsed.i<0)
+		{
+			HOMIE_LOGW("%s ignoring invalid payload %.*s (not one of %s)\n",friendlyName.c_str(),(int)len,payload,strFormat.c_str());
+			bValid=false;
+		}
+		break;
+	}
 
-	return true;
+	if(!bValid)
+	{
+		HOMIE_METRIC_INC(parent->parent->metrics,homieCounterRejectedPayload);
+		return;
+	}
+
+	HomieArraySlot old=*pSlot;
+	*pSlot=parsed;
+
+	if(publishMode!=homiePublishAlways && IsSameArraySlot(old,*pSlot))
+	{
+		suppressedCallbacks++;
+		suppressedPublishes++;
+		return;
+	}
+
+	arrayIndex=index;
+	DoCallback();
+	PublishArray(index);
+}
+
+bool HomieProperty::SetValueConstrained(const char * szNewValue, size_t len)
+{
+	if(ConstrainValue(szNewValue,len)) return true;
+
+	HOMIE_METRIC_INC(parent->parent->metrics,homieCounterRejectedPayload);
+	return false;
 }
 
-void HomieProperty::OnMqttMessage(char* topic, char* payload, AsyncMqttClientMessageProperties & properties, size_t len, size_t index, size_t total)
+bool HomieProperty::ConstrainValue(const char * szNewValue, size_t len)
 {
-	if(properties.retain || total)	//squelch unused parameter warnings
+	if(datatype==homieBinary) return AssignBinary(szNewValue,len);
+
+	char szTemp[HOMIE_NUMERIC_BUFFER];
+	const char * szValue=HomieConstrainPayload(datatype,strFormat,precision,friendlyName.c_str(),szNewValue,len,szTemp,sizeof(szTemp));
+	if(!szValue) return false;
+
+	if(datatype==homieColor)
 	{
+		//normalized above, so it parses
+		int32_t c[3];
+		HomieParseTriplet(szValue,len,c);
+
+		if(strFormat=="hsv")
+		{
+			colorHSV.h=(uint16_t)c[0];
+			colorHSV.s=(uint8_t)c[1];
+			colorHSV.v=(uint8_t)c[2];
+			colorRGB=HomieHSVtoRGB(colorHSV.h,colorHSV.s,colorHSV.v);
+		}
+		else
+		{
+			colorRGB=(c[0]<<16)+(c[1]<<8)+(c[2]<<0);
+			colorHSV=HomieRGBtoHSV(colorRGB);
+		}
 	}
 
-	if(index==0)
+	return AssignValue(szValue,len);
+}
+
+void HomieProperty::OnMqttMessage(char* szTopic, char* payload, AsyncMqttClientMessageProperties & properties, size_t len, size_t index, size_t total)
+{
+	if(properties.retain)	//squelch unused parameter warning
 	{
+	}
 
-		std::string temp;
-		temp.assign(payload,len);
+	if(index==0)
+	{
+		if(IsEcho(szTopic,payload,len))
+		{
+			//the broker now holds our own value, so there's nothing left to restore
+			HOMIE_LOGV("%s dropped echo of its own publish. Unsubscribing.\n",friendlyName.c_str());
+			droppedEchoes++;
+			HOMIE_METRIC_INC(parent->parent->metrics,homieCounterEchoDropped);
+			parent->parent->Mqtt().unsubscribe(szTopic);
+			receivedRetained=true;
+			return;
+		}
 
-		bool bValid=SetValueConstrained(String(temp.c_str()));
+		bool bValid;
+		if(len!=total)
+		{
+			//AsyncMqttClient hands payloads bigger than its buffer over in chunks and only the first one gets here
+			HOMIE_LOGW("%s ignoring %u byte payload, it arrived in chunks\n",friendlyName.c_str(),(unsigned int)total);
+			HOMIE_METRIC_INC(parent->parent->metrics,homieCounterRejectedPayload);
+			bValid=false;
+		}
+		else bValid=SetValueConstrained(payload,len);
+		bool bChanged=bValid && (valueChanged || externalValue);
 		//pProp->strValue.
 		if(bValid)
 		{
-			DoCallback();
+			externalValue=NULL;
+			if(bChanged || publishMode==homiePublishAlways) DoCallback(); else suppressedCallbacks++;
 		}
 
-		if(retained && !strcmp(topic,topic.c_str()) && !standardMQTT)
+		if(retained && !standardMQTT && IsBaseTopic(szTopic))
 		{
-#ifdef HOMIELIB_VERBOSE
-			csprintf("%s received initial value for base topic %s. Unsubscribing.\n",friendlyName.c_str(),topic.c_str());
-#endif
-			parent->parent->mqtt.unsubscribe(topic);
+			HOMIE_LOGV("%s received initial value for base topic %s. Unsubscribing.\n",friendlyName.c_str(),szTopic);
+			parent->parent->Mqtt().unsubscribe(szTopic);
 			receivedRetained=true;
 		}
 		else
 		{
 			if(bValid)
 			{
-				Publish();
+				if(ShouldPublish(bChanged)) Publish(); else suppressedPublishes++;
 			}
 		}
 
@@ -344,15 +977,137 @@ void HomieProperty::OnMqttMessage(char* topic, char* payload, AsyncMqttClientMes
 }
 
 
+void HomieProperty::ReservePending()
+{
+	if(pendingBuffer.size()) return;
+	pendingCapacity=valueCapacity?valueCapacity:GetDefaultValueCapacity();
+	pendingBuffer.resize(HOMIELIB_PENDING_SLOTS*pendingCapacity);
+}
+
+void HomieProperty::QueueValue(const char * szNewValue, size_t len)
+{
+	if(!pendingBuffer.size() || len>pendingCapacity)
+	{
+		HOMIE_LOGW("%s ignoring queued value of %i bytes (capacity %i)\n",friendlyName.c_str(),(int)len,(int)pendingCapacity);
+		return;
+	}
+
+	//claim a slot nobody holds. With more concurrent producers than free slots the newest value wins anyway.
+	uint8_t busy=pendingBusy.load(std::memory_order_relaxed);
+	int slot;
+	do
+	{
+		for(slot=0;slot<HOMIELIB_PENDING_SLOTS && (busy&(1<<slot));slot++) {}
+		if(slot==HOMIELIB_PENDING_SLOTS) return;
+	} while(!pendingBusy.compare_exchange_weak(busy,busy|(1<<slot),std::memory_order_acquire,std::memory_order_relaxed));
+
+	memcpy(pendingBuffer.data()+slot*pendingCapacity,szNewValue,len);
+	pendingLength[slot]=len;
+
+	//the value we replace was never taken, its slot is free again
+	int8_t previous=pendingLatest.exchange(slot,std::memory_order_acq_rel);
+	if(previous>=0) pendingBusy.fetch_and(~(1<<previous),std::memory_order_release);
+
+	if(!pendingQueued.exchange(true)) parent->parent->QueueProperty(this);
+}
+
+void HomieProperty::ApplyQueuedValue()
+{
+	//release first, a value set from now on queues the property again
+	pendingQueued=false;
+
+	int8_t slot=pendingLatest.exchange(-1,std::memory_order_acq_rel);
+	if(slot<0) return;
+
+	//the slot stays busy while we read it, so no producer writes into it
+	SetValueSpan(pendingBuffer.data()+slot*pendingCapacity,pendingLength[slot]);
+	pendingBusy.fetch_and(~(1<<slot),std::memory_order_release);
+}
+
+const char * HomieProperty::GetTopic(char * szOut, size_t size, const char * szSuffix)
+{
+	int len;
+	if(standardMQTT) len=snprintf(szOut,size,"%s%s",topic.c_str(),szSuffix);
+	else len=snprintf(szOut,size,"%s/%s/%s%s",parent->parent->topic.c_str(),parent->id.c_str(),id.c_str(),szSuffix);
+
+	if(len<0 || (size_t)len>=size)
+	{
+		HOMIE_LOGE("Topic of %s/%s doesn't fit in %u bytes\n",parent->id.c_str(),id.c_str(),(unsigned int)size);
+		*szOut=0;
+	}
+	return szOut;
+}
+
+bool HomieProperty::IsBaseTopic(const char * szTopic)
+{
+	if(standardMQTT) return !strcmp(szTopic,topic.c_str());
+
+	const String & strDevice=parent->parent->topic;
+	if(strncmp(szTopic,strDevice.c_str(),strDevice.length()) || szTopic[strDevice.length()]!='/') return false;
+	szTopic+=strDevice.length()+1;
+
+	if(strncmp(szTopic,parent->id.c_str(),parent->id.length()) || szTopic[parent->id.length()]!='/') return false;
+	szTopic+=parent->id.length()+1;
+
+	return !strcmp(szTopic,id.c_str());
+}
+
+void HomieProperty::RememberEcho(const char * payload, size_t len)
+{
+	HomieEcho & slot=echo[echoNext];
+	slot.hash=HomieHash(payload,len);
+	slot.length=(uint32_t)len;
+	slot.timestamp=millis();
+	echoUsed|=1<<echoNext;
+	echoNext=(echoNext+1)%HOMIELIB_ECHO_SLOTS;
+}
+
+bool HomieProperty::IsEcho(const char * szTopic, const char * payload, size_t len)
+{
+	if(!echoUsed || !IsBaseTopic(szTopic)) return false;
+
+	uint32_t hash=0;
+	bool bHashed=false;
+	for(int a=0;a<HOMIELIB_ECHO_SLOTS;a++)
+	{
+		if(!(echoUsed&(1<<a))) continue;
+
+		HomieEcho & slot=echo[a];
+		if(millis()-slot.timestamp>=echoWindow_ms)
+		{
+			echoUsed&=~(1<<a);	//too old to still be on its way
+			continue;
+		}
+
+		if(slot.length!=len) continue;
+		if(!bHashed)
+		{
+			hash=HomieHash(payload,len);
+			bHashed=true;
+		}
+		if(slot.hash==hash)
+		{
+			echoUsed=0; //we unsubscribe now, the others won't be looked for
+			return true;
+		}
+	}
+	return false;
+}
+
 HomieNode::HomieNode()
 {
 
 }
 
+void HomieNode::SetArray(uint16_t count)
+{
+	if(parent->initialized) return;
+	arraySize=count;
+}
+
 void HomieNode::Init()
 {
 
-	topic=parent->topic+"/"+id;
 	for(size_t a=0;a<vecProperty.size();a++)
 	{
 		vecProperty[a]->Init();
@@ -360,6 +1115,25 @@ void HomieNode::Init()
 }
 
 
+const char * HomieNode::GetTopic(char * szOut, size_t size, const char * szSuffix)
+{
+	int len=snprintf(szOut,size,"%s/%s%s",parent->topic.c_str(),id.c_str(),szSuffix);
+	if(len<0 || (size_t)len>=size)
+	{
+		HOMIE_LOGE("Topic of %s doesn't fit in %u bytes\n",id.c_str(),(unsigned int)size);
+		*szOut=0;
+	}
+	return szOut;
+}
+
+void HomieNode::PublishHeartbeats()
+{
+	for(size_t a=0;a<vecProperty.size();a++)
+	{
+		vecProperty[a]->PublishHeartbeat();
+	}
+}
+
 void HomieNode::PublishDefaults()
 {
 	for(size_t a=0;a<vecProperty.size();a++)
@@ -370,9 +1144,16 @@ void HomieNode::PublishDefaults()
 
 HomieProperty * HomieNode::NewProperty()
 {
-	HomieProperty * ret=new HomieProperty;
+	HOMIE_ALLOC_SCOPE(homieAllocTree);
+	HomieProperty * ret=parent->arena.New<HomieProperty>();
 	vecProperty.push_back(ret);
 	ret->parent=this;
+	parent->index.Invalidate();
 	return ret;
 }
 
+HomieProperty * HomieNode::FindProperty(const char * szId)
+{
+	return parent->FindProperty(id.c_str(),id.length(),szId,strlen(szId));
+}
+
@@ -1,7 +1,29 @@
 #pragma once
 #include "Arduino.h"
+#include "HomieColor.h"
 
 #include <functional>
+#include <atomic>
+
+#ifndef HOMIELIB_STRING_CAPACITY
+#define HOMIELIB_STRING_CAPACITY 64 //default value capacity of string properties in static memory mode
+#endif
+
+#ifndef HOMIELIB_PENDING_SLOTS
+#define HOMIELIB_PENDING_SLOTS 4 //worker mode value slots per property, up to two producers at once never drop a value
+#endif
+
+#ifndef HOMIELIB_TOPIC_BUFFER
+#define HOMIELIB_TOPIC_BUFFER 128 //property and node topics are built into stack buffers of this size when needed
+#endif
+
+#ifndef HOMIELIB_ECHO_SLOTS
+#define HOMIELIB_ECHO_SLOTS 4 //recent publishes per property that are recognized when they come back, at most 8
+#endif
+
+#ifndef HOMIELIB_ARRAY_HEARTBEAT_BATCH
+#define HOMIELIB_ARRAY_HEARTBEAT_BATCH 16 //$array instances a heartbeat sends per second, the rest follow in later seconds
+#endif
 
 class HomieProperty;
 class HomieNode;
@@ -20,20 +42,68 @@ enum eHomieDataType
 	homieEnum,
 	homieColor,
 	homieColour = homieColor,
+	homieBinary, //packed little-endian vector, see HomieProperty::SetBinaryLayout
+};
+
+enum eHomieBinaryLayout
+{
+	homieBinaryInt16,
+	homieBinaryInt32,
+	homieBinaryFloat32,
+};
+
+size_t GetHomieBinaryElementSize(eHomieBinaryLayout layout);
+
+enum eHomiePublishMode
+{
+	homiePublishAlways,				 //every SetValue and accepted /set publishes and calls back, even if nothing changed
+	homiePublishOnChange,			 //only when the normalized value changed
+	homiePublishOnChangeOrHeartbeat, //on change, and at least every heartbeat_ms
+};
+
+//Outbound priority. Lanes are drained in this order every loop, and initial publishing (metadata) only
+//continues while nothing is waiting. A publish waits in its lane while a more urgent one is queued,
+//or when the client refused it because its buffer is full. Lanes belong to the connection, so a gateway's virtual
+//devices queue behind each other's urgent publishes.
+enum eHomiePublishLane
+{
+	homieLaneUrgent, //events that must not wait, e.g. a doorbell
+	homieLaneLive,	 //ordinary values
+	homieLaneStats,	 //low priority telemetry. $stats go at this priority too, once nothing is queued up to here
+	homieLaneMeta,	 //initial publishing, can't be chosen for a property
+	homieLaneCount,
 };
 
 const char *GetHomieDataTypeText(eHomieDataType datatype);
+bool HomieParseDataType(const char *text, size_t len, eHomieDataType &datatype); //the reverse, for homie datatypes
 bool HomieDataTypeAllowsEmpty(eHomieDataType datatype);
+bool HomieDataTypeAllowsArray(eHomieDataType datatype); //fits a HomieArraySlot
 const char *GetDefaultForHomieDataType(eHomieDataType datatype);
 
+//Checks a payload against a datatype and $format like a local /set, and normalizes numbers and colors into szTemp
+//(at least HOMIE_NUMERIC_BUFFER bytes), e.g. "22.0" to "22". Returns the text to keep, payload itself or szTemp, with
+//its length in len, or NULL after logging why not for szName. Binary payloads pass unchecked.
+const char *HomieConstrainPayload(eHomieDataType datatype, const String &strFormat, int precision, const char *szName, const char *payload, size_t &len, char *szTemp, size_t size);
+
 struct AsyncMqttClientMessageProperties;
 
+//One value of a $array node property. Ints, bools (0/1), colors and enums (option index) use i, floats use f.
+//Colors are packed as 0x00RRGGBB, or 0x0HHHSSVV (hue 0-360, saturation and value 0-100) for $format hsv, so a
+///set comes back exactly as it was sent.
+union HomieArraySlot
+{
+	int32_t i;
+	float f;
+};
+
 class HomieProperty
 {
 public:
 	HomieProperty();
 
 	void SetStandardMQTT(const String &strMqttTopic); //call before init to subscribe to a standard MQTT topic. Receive only.
+	bool IsStandardMQTT() { return standardMQTT; }
+	const String &GetStandardMQTTTopic() { return topic; }
 
 	String id;
 	String friendlyName;
@@ -43,6 +113,11 @@ public:
 	String unit;
 	eHomieDataType datatype = homieString;
 	String strFormat;
+	int precision = -1; //decimals for float values, -1 for the shortest text that round-trips
+	eHomiePublishMode publishMode = homiePublishAlways;
+	unsigned long heartbeat_ms = 60000;
+	eHomiePublishLane lane = homieLaneLive;
+	size_t valueCapacity = 0; //static memory mode: longest value accepted, 0 to size it from datatype and $format at Init
 
 	void Init();
 
@@ -50,29 +125,139 @@ public:
 
 	const String &GetValue();
 	void SetValue(const String &newValue);
+	void SetValue(const char *newValue);
 	void SetBool(bool value);
+	void SetInt(int32_t value);
+	void SetFloat(double value);
+
+	//color properties are validated against $format (rgb or hsv, default rgb) and kept unpacked
+	uint32_t GetRGB();
+	HomieHSV GetHSV();
+	void SetRGB(uint32_t rgb);
+	void SetHSV(const HomieHSV &hsv);
+
+	//Properties of $array nodes keep one value per index instead of GetValue()/SetValue().
+	//The setters publish but don't validate against $format. Colors are packed like in HomieArraySlot.
+	int32_t GetArrayInt(uint16_t index);
+	double GetArrayFloat(uint16_t index);
+	void SetArrayInt(uint16_t index, int32_t value);
+	void SetArrayFloat(uint16_t index, double value);
+	uint16_t GetArrayIndex() { return arrayIndex; } //index of the /set being handled, for callbacks
+	bool PublishArray(uint16_t index);
 
 	bool Publish();
 
-	void OnMqttMessage(char *topic, char *payload, AsyncMqttClientMessageProperties &properties, size_t len, size_t index, size_t total);
+	unsigned long GetSuppressedPublishes() { return suppressedPublishes; }
+	unsigned long GetSuppressedCallbacks() { return suppressedCallbacks; }
+	unsigned long GetDroppedEchoes() { return droppedEchoes; }
+
+	//Large values without a String copy. PublishSpan sends the caller's bytes once, SetValueExternal makes the
+	//caller's buffer the property's value (also for republishing after reconnect) until the next SetValue.
+	//The buffer must stay valid until then. GetValue() is empty while an external value is set.
+	bool PublishSpan(const char *payload, size_t length);
+	void SetValueExternal(const char *payload, size_t length);
+
+	//Binary properties carry packed little-endian vectors instead of text. $datatype is string and $format describes
+	//the layout, e.g. "binary:int16le[64]", or "binary:int16le[]" if count is 0 (any length). Call before Init.
+	//Not supported on $array nodes.
+	void SetBinaryLayout(eHomieBinaryLayout layout, uint16_t count = 0);
+	eHomieBinaryLayout GetBinaryLayout() { return binaryLayout; }
+	uint16_t GetBinaryLayoutCount() { return binaryCount; }
+
+	//Publishes straight from the caller's buffer. Retained properties also keep a copy for republishing after reconnect.
+	bool PublishBinary(const void *data, uint16_t count);
+
+	//The last value published or accepted from /set, NULL if the layout doesn't match or there's no value
+	uint16_t GetBinaryCount() { return binaryLength / GetHomieBinaryElementSize(binaryLayout); }
+	const int16_t *GetBinaryInt16() { return binaryLayout == homieBinaryInt16 && binaryLength ? (const int16_t *)binaryValue.data() : NULL; }
+	const int32_t *GetBinaryInt32() { return binaryLayout == homieBinaryInt32 && binaryLength ? (const int32_t *)binaryValue.data() : NULL; }
+	const float *GetBinaryFloat32() { return binaryLayout == homieBinaryFloat32 && binaryLength ? (const float *)binaryValue.data() : NULL; }
+
+	void OnMqttMessage(char *szTopic, char *payload, AsyncMqttClientMessageProperties &properties, size_t len, size_t index, size_t total);
 
 private:
-	String topic;
-	String setTopic;
+	String topic; //standard MQTT only, homie topics aren't stored
 	HomieNode *parent;
+
+	//<device>/<node>/<id><suffix>, or the standard MQTT topic. Empty if it doesn't fit.
+	const char *GetTopic(char *szOut, size_t size, const char *szSuffix = "");
+	bool IsBaseTopic(const char *szTopic); //compares without building the topic
 	String value;
+	const char *externalValue = NULL;
+	size_t externalLength = 0;
+	uint32_t colorRGB = 0;
+	HomieHSV colorHSV = {0, 0, 0};
 	std::vector<HomiePropertyCallback> callback;
 
+	eHomieBinaryLayout binaryLayout = homieBinaryInt16;
+	uint16_t binaryCount = 0;
+	std::vector<uint32_t> binaryValue; //words keep the elements aligned
+	size_t binaryLength = 0;		   //in bytes
+	bool AssignBinary(const char *payload, size_t len);
+
+	std::vector<HomieArraySlot> arrayValue;
+	uint16_t arrayIndex = 0;
+	uint16_t heartbeatIndex = 0; //next $array instance of the heartbeat round in progress
+	HomieArraySlot *GetArraySlot(uint16_t index);
+	bool IsSameArraySlot(const HomieArraySlot &a, const HomieArraySlot &b);
+	size_t FormatArraySlot(uint16_t index, char *szOut, size_t size);
+	void OnArrayMessage(uint16_t index, const char *payload, size_t len);
+
 	bool initialized = false;
 
+	//Worker mode hand-off, see HomieDevice::StartWorker. A producer claims a free slot, fills it and swaps it in
+	//as the latest value, the worker swaps the latest out. Neither side waits or allocates.
+	std::vector<char> pendingBuffer; //HOMIELIB_PENDING_SLOTS*pendingCapacity bytes, sized by StartWorker
+	size_t pendingCapacity = 0;
+	size_t pendingLength[HOMIELIB_PENDING_SLOTS];
+	std::atomic<uint8_t> pendingBusy{0};   //bit per slot, held by a producer, the latest value or the worker
+	std::atomic<int8_t> pendingLatest{-1}; //slot with the newest value, -1 for none
+	std::atomic<bool> pendingQueued{false};
+	HomieProperty *pendingNext = NULL;
+	void ReservePending();
+	void QueueValue(const char *szNewValue, size_t len);
+	void ApplyQueuedValue();
+
 	friend class HomieDevice;
 	friend class HomieNode;
+	friend class HomieIndex;
+	friend class HomieTopicAliases;
 	void DoCallback();
 
-	bool SetValueConstrained(const String &strNewValue);
+	void SetValueSpan(const char *szNewValue, size_t len);
+	bool SetValueConstrained(const char *szNewValue, size_t len);
+	bool ConstrainValue(const char *szNewValue, size_t len);
+	bool AssignValue(const char *szNewValue, size_t len);
+	size_t GetDefaultValueCapacity();
+
+	bool valueChanged = false; //set by SetValueConstrained
+	unsigned long lastPublishTimestamp = 0;
+	unsigned long suppressedPublishes = 0;
+	unsigned long suppressedCallbacks = 0;
+	bool ShouldPublish(bool bChanged);
+	bool PublishValue();
+	bool lanePending = false;
+
+	//see HomieTopicAliases
+	uint16_t topicAlias = 0;
+	uint16_t topicAliasSession = 0;
+	uint32_t topicAliasScore = 0; //publishes, halved at every rebalance
 
-	bool ValidateFormat_Int(int &min, int &max);
-	bool ValidateFormat_Double(double &min, double &max);
+	//While subscribed to the base topic to restore a retained value, our own publishes come back. The recent ones
+	//are remembered in a ring so any of them can be dropped before validation and callbacks.
+	struct HomieEcho
+	{
+		uint32_t hash;
+		uint32_t length;
+		unsigned long timestamp;
+	};
+	HomieEcho echo[HOMIELIB_ECHO_SLOTS];
+	uint8_t echoUsed = 0; //bit per slot
+	uint8_t echoNext = 0;
+	unsigned long droppedEchoes = 0;
+	void RememberEcho(const char *payload, size_t len);
+	bool IsEcho(const char *szTopic, const char *payload, size_t len);
+	void PublishHeartbeat();
 
 	void PublishDefault();
 
@@ -92,14 +277,30 @@ public:
 
 	HomieProperty *NewProperty();
 
+	size_t GetPropertyCount() { return vecProperty.size(); }
+	HomieProperty *GetProperty(size_t index) { return index < vecProperty.size() ? vecProperty[index] : NULL; }
+	HomieProperty *FindProperty(const char *id);
+
+	//Call before Init to make this a homie $array node with instances <id>_0 to <id>_<count-1>.
+	//The properties are the schema shared by every instance. String and binary properties aren't supported here,
+	//Init leaves them out with an error.
+	void SetArray(uint16_t count);
+	bool IsArray() { return arraySize > 0; }
+	uint16_t GetArraySize() { return arraySize; }
+
 private:
+	uint16_t arraySize = 0;
+
 	void Init();
 	std::vector<HomieProperty *> vecProperty;
 
 	friend class HomieDevice;
 	friend class HomieProperty;
+	friend class HomieIndex;
 	HomieDevice *parent;
-	String topic;
+
+	const char *GetTopic(char *szOut, size_t size, const char *szSuffix = ""); //<device>/<id><suffix>
 
 	void PublishDefaults();
+	void PublishHeartbeats();
 };
@@ -0,0 +1,197 @@
+#include "HomieNumeric.h"
+
+bool HomieParseInt(const char *in, size_t len, int32_t &out)
+{
+	size_t i = 0;
+	bool bNegative = false;
+
+	if (i < len && (in[i] == '-' || in[i] == '+'))
+	{
+		bNegative = in[i] == '-';
+		i++;
+	}
+
+	if (i >= len)
+		return false;
+
+	//accumulate negative so INT32_MIN fits
+	int32_t value = 0;
+	for (; i < len; i++)
+	{
+		char c = in[i];
+		if (c < '0' || c > '9')
+			return false;
+
+		int digit = c - '0';
+		if (value < (INT32_MIN + digit) / 10)
+			return false; //overflow
+
+		value = value * 10 - digit;
+	}
+
+	if (!bNegative)
+	{
+		if (value == INT32_MIN)
+			return false;
+		value = -value;
+	}
+
+	out = value;
+	return true;
+}
+
+bool HomieParseFloat(const char *in, size_t len, double &out)
+{
+	//validate the grammar here, [-+]digits[.digits][(e|E)[-+]digits], strtod is too lenient
+	char szTemp[64];
+	if (len == 0 || len >= sizeof(szTemp))
+		return false;
+
+	size_t i = 0;
+	if (in[i] == '-' || in[i] == '+')
+		i++;
+
+	size_t digits = 0;
+	while (i < len && in[i] >= '0' && in[i] <= '9')
+	{
+		i++;
+		digits++;
+	}
+
+	if (i < len && in[i] == '.')
+	{
+		i++;
+		while (i < len && in[i] >= '0' && in[i] <= '9')
+		{
+			i++;
+			digits++;
+		}
+	}
+
+	if (!digits)
+		return false;
+
+	if (i < len && (in[i] == 'e' || in[i] == 'E'))
+	{
+		i++;
+		if (i < len && (in[i] == '-' || in[i] == '+'))
+			i++;
+
+		size_t expDigits = 0;
+		while (i < len && in[i] >= '0' && in[i] <= '9')
+		{
+			i++;
+			expDigits++;
+		}
+
+		if (!expDigits)
+			return false;
+	}
+
+	if (i != len)
+		return false;
+
+	memcpy(szTemp, in, len);
+	szTemp[len] = 0;
+
+	out = strtod(szTemp, NULL);
+	return true;
+}
+
+bool HomieParseTriplet(const char *in, size_t len, int32_t out[3])
+{
+	size_t start = 0;
+
+	for (int a = 0; a < 3; a++)
+	{
+		size_t end = start;
+		while (end < len && in[end] != ',')
+			end++;
+
+		if ((a < 2) != (end < len))
+			return false; //too few or too many fields
+
+		if (!HomieParseInt(in + start, end - start, out[a]))
+			return false;
+
+		start = end + 1;
+	}
+
+	return true;
+}
+
+size_t HomieFormatInt(char *out, size_t size, int32_t value)
+{
+	char szTemp[12];
+	size_t len = 0;
+
+	//work with the negative value so INT32_MIN doesn't overflow
+	bool bNegative = value < 0;
+	int32_t remaining = bNegative ? value : -value;
+
+	do
+	{
+		szTemp[len++] = (char)('0' - remaining % 10);
+		remaining /= 10;
+	} while (remaining);
+
+	if (bNegative)
+		szTemp[len++] = '-';
+
+	if (len + 1 > size)
+		return 0;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		out[i] = szTemp[len - 1 - i];
+	}
+	out[len] = 0;
+
+	return len;
+}
+
+size_t HomieFormatFloat(char *out, size_t size, double value, int precision)
+{
+	int len;
+
+	if (isnan(value) || isinf(value))
+		return 0; //no homie representation
+
+	if (precision >= 0)
+	{
+		len = snprintf(out, size, "%.*f", precision, value);
+		if (len > 0 && (size_t)len < size)
+			return (size_t)len;
+		//too wide for fixed point (1e40 is 41 digits before the point), the exponent form below always fits
+	}
+	else if (value == 0 || (fabs(value) >= 1e-5 && fabs(value) < 1e15))
+	{
+		//fewest decimals that round-trip, so 20 is "20" and 21.5 is "21.5". Most values need one or two tries.
+		if (value == 0)
+			value = 0; //no "-0"
+		for (int decimals = 0; decimals <= 17; decimals++)
+		{
+			len = snprintf(out, size, "%.*f", decimals, value);
+			if (len <= 0 || (size_t)len >= size)
+				break;
+			if (strtod(out, NULL) == value)
+				return (size_t)len;
+		}
+	}
+
+	//very large or small magnitudes, or digits fixed point can't hold: shortest exponent form that round-trips
+	len = 0;
+	for (int digits = 1; digits <= 17; digits++)
+	{
+		len = snprintf(out, size, "%.*g", digits, value);
+		if (len <= 0 || (size_t)len >= size)
+			return 0;
+		if (strtod(out, NULL) == value)
+			break;
+	}
+
+	if (len <= 0 || (size_t)len >= size)
+		return 0;
+
+	return (size_t)len;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "Arduino.h"
+
+//Allocation-free numeric parsing and formatting for property payloads.
+
+//Strict, length-bounded parsers. The whole input must be a number, so "abc", "12abc" or "" are errors
+//rather than silently becoming 0. The input doesn't need to be zero terminated.
+bool HomieParseInt(const char *in, size_t len, int32_t &out);
+bool HomieParseFloat(const char *in, size_t len, double &out);
+
+//Parses "a,b,c" as used by color payloads.
+bool HomieParseTriplet(const char *in, size_t len, int32_t out[3]);
+
+//Formatters write a zero terminated string into the caller's buffer and return its length, or 0 if it didn't fit.
+size_t HomieFormatInt(char *out, size_t size, int32_t value);
+
+//precision<0 gives the shortest fixed point text that parses back to exactly the same double ("20", "21.5"), and
+//exponent form ("1e+40") only below 1e-5 or from 1e15 on. A value whose fixed point text with precision decimals
+//doesn't fit the buffer, like 1e40 with precision 2, also gets the exponent form instead of failing.
+size_t HomieFormatFloat(char *out, size_t size, double value, int precision = -1);
+
+//Fits any HomieFormatInt value and the longest shortest-form double (24 chars, -2.2250738585072014e-308).
+//Fixed point with precision decimals can need more, up to 309 digits for DBL_MAX, see HomieFormatFloat.
+#define HOMIE_NUMERIC_BUFFER 32
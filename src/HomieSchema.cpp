@@ -0,0 +1,280 @@
+#include "HomieSchema.h"
+#include "HomieDevice.h"
+#include "HomieNode.h"
+#include "HomieLog.h"
+
+static const uint8_t schemaVersion = 2; //2 added standard MQTT topics and value capacity, 1 is still loaded
+
+enum
+{
+	schemaFlagSettable = 1,
+	schemaFlagRetained = 2,
+	schemaFlagPublishEmptyString = 4,
+	schemaFlagStandardMQTT = 8,
+};
+
+class HomieSchemaReader
+{
+public:
+	HomieSchemaReader(const uint8_t *blobIn, size_t sizeIn) : blob(blobIn), size(sizeIn) {}
+
+	bool ok = true;
+
+	uint8_t U8()
+	{
+		if (pos >= size)
+		{
+			ok = false;
+			return 0;
+		}
+#ifdef pgm_read_byte
+		return pgm_read_byte(blob + pos++);
+#else
+		return blob[pos++];
+#endif
+	}
+
+	uint16_t U16()
+	{
+		uint16_t ret = U8();
+		return ret | (U8() << 8);
+	}
+
+	uint32_t U32()
+	{
+		uint32_t ret = U16();
+		return ret | ((uint32_t)U16() << 16);
+	}
+
+	void Str(String &out)
+	{
+		uint8_t len = U8();
+		if (pos + len > size)
+		{
+			ok = false;
+			return;
+		}
+
+		out = "";
+		out.reserve(len);
+		for (uint8_t i = 0; i < len; i++)
+		{
+			out.concat((char)U8());
+		}
+	}
+
+	bool AtEnd() { return pos == size; }
+
+private:
+	const uint8_t *blob;
+	size_t size;
+	size_t pos = 0;
+};
+
+class HomieSchemaWriter
+{
+public:
+	HomieSchemaWriter(uint8_t *outIn, size_t sizeIn) : out(outIn), size(sizeIn) {}
+
+	bool ok = true;
+	size_t pos = 0;
+
+	void U8(uint8_t value)
+	{
+		if (out && pos < size)
+			out[pos] = value;
+		pos++;
+	}
+
+	void U16(uint16_t value)
+	{
+		U8(value & 0xFF);
+		U8(value >> 8);
+	}
+
+	void U32(uint32_t value)
+	{
+		U16(value & 0xFFFF);
+		U16(value >> 16);
+	}
+
+	void Str(const String &value)
+	{
+		if (value.length() > 255)
+		{
+			HOMIE_LOGE("Schema export: \"%s\" is too long\n", value.c_str());
+			ok = false;
+			return;
+		}
+
+		U8(value.length());
+		for (size_t i = 0; i < value.length(); i++)
+		{
+			U8(value[i]);
+		}
+	}
+
+private:
+	uint8_t *out;
+	size_t size;
+};
+
+bool HomieSchemaLoad(HomieDevice &device, const uint8_t *blob, size_t size)
+{
+	if (device.GetNodeCount())
+	{
+		HOMIE_LOGE("Schema load needs an empty device\n");
+		return false;
+	}
+
+	HomieSchemaReader in(blob, size);
+
+	uint8_t version = 0;
+	if (in.U8() != 'H' || in.U8() != 'S' || (version = in.U8()) < 1 || version > schemaVersion)
+	{
+		HOMIE_LOGE("Schema load: not a version %u schema\n", schemaVersion);
+		return false;
+	}
+
+	uint16_t nodes = in.U16();
+	uint16_t properties = in.U16();
+	device.Reserve(nodes, properties);
+
+	uint32_t propertiesRead = 0;
+
+	for (uint16_t a = 0; a < nodes && in.ok; a++)
+	{
+		HomieNode *pNode = device.NewNode();
+		in.Str(pNode->id);
+		in.Str(pNode->friendlyName);
+		in.Str(pNode->type);
+
+		uint16_t arraySize = in.U16();
+		if (arraySize)
+			pNode->SetArray(arraySize);
+
+		uint16_t count = in.U16();
+		propertiesRead += count;
+		if (propertiesRead > properties)
+			in.ok = false;
+
+		for (uint16_t b = 0; b < count && in.ok; b++)
+		{
+			HomieProperty *pProp = pNode->NewProperty();
+			in.Str(pProp->id);
+			in.Str(pProp->friendlyName);
+			in.Str(pProp->unit);
+			in.Str(pProp->strFormat);
+
+			uint8_t datatype = in.U8();
+			uint8_t flags = in.U8();
+			String strTopic;
+			if (version >= 2)
+			{
+				pProp->valueCapacity = in.U16();
+				if (flags & schemaFlagStandardMQTT)
+					in.Str(strTopic);
+			}
+			pProp->precision = (int8_t)in.U8();
+			pProp->publishMode = (eHomiePublishMode)in.U8();
+			pProp->lane = (eHomiePublishLane)in.U8();
+			eHomieBinaryLayout layout = (eHomieBinaryLayout)in.U8();
+			uint16_t binaryCount = in.U16();
+			pProp->heartbeat_ms = in.U32();
+
+			pProp->datatype = (eHomieDataType)datatype;
+			pProp->settable = flags & schemaFlagSettable;
+			pProp->retained = flags & schemaFlagRetained;
+			pProp->publishEmptyString = flags & schemaFlagPublishEmptyString;
+			if (flags & schemaFlagStandardMQTT)
+				pProp->SetStandardMQTT(strTopic);
+
+			if (datatype > homieBinary || pProp->publishMode > homiePublishOnChangeOrHeartbeat || pProp->lane >= homieLaneMeta || layout > homieBinaryFloat32)
+				in.ok = false;
+			else if (pProp->datatype == homieBinary)
+				pProp->SetBinaryLayout(layout, binaryCount);
+		}
+	}
+
+	if (!in.ok || !in.AtEnd() || propertiesRead != properties)
+	{
+		HOMIE_LOGE("Schema load: blob is truncated or corrupt\n");
+		device.Clear();
+		return false;
+	}
+
+	HOMIE_LOGD("Schema loaded, %u nodes, %u properties\n", nodes, properties);
+	return true;
+}
+
+size_t HomieSchemaExport(HomieDevice &device, uint8_t *out, size_t size)
+{
+	HomieSchemaWriter w(out, size);
+
+	size_t properties = 0;
+	for (size_t a = 0; a < device.GetNodeCount(); a++)
+	{
+		properties += device.GetNode(a)->GetPropertyCount();
+	}
+
+	if (device.GetNodeCount() > 0xFFFF || properties > 0xFFFF)
+	{
+		HOMIE_LOGE("Schema export: %u nodes and %u properties don't fit the 16 bit counts\n", (unsigned)device.GetNodeCount(), (unsigned)properties);
+		return 0;
+	}
+
+	w.U8('H');
+	w.U8('S');
+	w.U8(schemaVersion);
+	w.U16(device.GetNodeCount());
+	w.U16(properties);
+
+	for (size_t a = 0; a < device.GetNodeCount(); a++)
+	{
+		HomieNode *pNode = device.GetNode(a);
+		w.Str(pNode->id);
+		w.Str(pNode->friendlyName);
+		w.Str(pNode->type);
+		w.U16(pNode->GetArraySize());
+		w.U16(pNode->GetPropertyCount());
+
+		for (size_t b = 0; b < pNode->GetPropertyCount(); b++)
+		{
+			HomieProperty *pProp = pNode->GetProperty(b);
+			w.Str(pProp->id);
+			w.Str(pProp->friendlyName);
+			w.Str(pProp->unit);
+			w.Str(pProp->strFormat);
+
+			uint8_t flags = 0;
+			if (pProp->settable)
+				flags |= schemaFlagSettable;
+			if (pProp->retained)
+				flags |= schemaFlagRetained;
+			if (pProp->publishEmptyString)
+				flags |= schemaFlagPublishEmptyString;
+			if (pProp->IsStandardMQTT())
+				flags |= schemaFlagStandardMQTT;
+
+			if (pProp->valueCapacity > 0xFFFF)
+			{
+				HOMIE_LOGE("Schema export: value capacity %u of %s doesn't fit 16 bits\n", (unsigned)pProp->valueCapacity, pProp->id.c_str());
+				w.ok = false;
+			}
+
+			w.U8(pProp->datatype);
+			w.U8(flags);
+			w.U16(pProp->valueCapacity);
+			if (pProp->IsStandardMQTT())
+				w.Str(pProp->GetStandardMQTTTopic());
+			w.U8((uint8_t)(int8_t)pProp->precision);
+			w.U8(pProp->publishMode);
+			w.U8(pProp->lane);
+			w.U8(pProp->GetBinaryLayout());
+			w.U16(pProp->GetBinaryLayoutCount());
+			w.U32(pProp->heartbeat_ms);
+		}
+	}
+
+	return w.ok ? w.pos : 0;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "Arduino.h"
+
+class HomieDevice;
+
+//Compact binary description of a device tree (nodes and properties with all their attributes, no values or
+//callbacks), so layouts can be shipped as data. Little-endian, strings are a length byte and the text.
+//
+//  "HS" 2                          magic and version, version 1 blobs (without capacity and topic) still load
+//  u16 nodes, u16 properties       totals, used to size the arena before building
+//  per node:     str id, str name, str type, u16 array size, u16 property count
+//  per property: str id, str name, str unit, str format,
+//                u8 datatype, u8 flags (1 settable, 2 retained, 4 publish empty string, 8 standard MQTT),
+//                u16 value capacity, str topic (standard MQTT only), i8 precision,
+//                u8 publish mode, u8 lane, u8 binary layout, u16 binary count, u32 heartbeat_ms
+
+//Build the tree of an empty device that hasn't been Init'ed yet, in one pass. The blob may be in PROGMEM.
+//On failure the device is cleared again.
+bool HomieSchemaLoad(HomieDevice &device, const uint8_t *blob, size_t size);
+
+//Write the device's tree to out and return the blob size. If out is NULL or too small nothing past size is written,
+//so call with NULL first to get the size. Returns 0 if a string is longer than 255 characters, there are more than
+//65535 nodes or properties, or a value capacity is over 65535.
+size_t HomieSchemaExport(HomieDevice &device, uint8_t *out, size_t size);
@@ -0,0 +1,109 @@
+#include "HomieTopicAlias.h"
+#include "HomieNode.h"
+#include <algorithm>
+
+//Topic Alias property on the wire: 1 byte identifier, 2 bytes value
+static const size_t aliasPropertySize = 3;
+
+static_assert(HOMIELIB_TOPIC_ALIAS_MAX <= 64, "Rebalance keeps the used slots in one 64 bit mask");
+
+void HomieTopicAliases::OnConnected(uint16_t aliasMaximum)
+{
+	maximum = aliasMaximum;
+
+	//the broker forgot every alias, each one is announced with its topic again
+	session++;
+	if (!session)
+		session++;
+
+	rebalanceTimestamp = 0; //the number of slots may have changed
+}
+
+static uint16_t GetSlots(uint16_t maximum, uint16_t estimateMaximum)
+{
+	uint16_t slots = maximum ? maximum : estimateMaximum;
+	return slots < HOMIELIB_TOPIC_ALIAS_MAX ? slots : HOMIELIB_TOPIC_ALIAS_MAX;
+}
+
+uint16_t HomieTopicAliases::OnPublish(HomieProperty *pProp, size_t topicLength, bool &bSendTopic)
+{
+	pProp->topicAliasScore++;
+	bytesTopic += topicLength;
+	bSendTopic = true;
+
+	uint16_t slots = GetSlots(maximum, estimateMaximum);
+	if (!pProp->topicAlias || pProp->topicAlias > slots)
+		return 0;
+
+	unsigned long &bytes = maximum ? bytesSaved : bytesSavable;
+	if (pProp->topicAliasSession != session)
+	{
+		//first use in this session maps the alias, that costs the property on top of the full topic
+		pProp->topicAliasSession = session;
+		bytes = bytes > aliasPropertySize ? bytes - aliasPropertySize : 0;
+	}
+	else
+	{
+		bSendTopic = false;
+		if (topicLength > aliasPropertySize)
+			bytes += topicLength - aliasPropertySize;
+	}
+
+	return maximum ? pProp->topicAlias : 0;
+}
+
+bool HomieTopicAliases::IsRebalanceDue()
+{
+	return !rebalanceTimestamp || (millis() - rebalanceTimestamp) >= rebalanceInterval_ms;
+}
+
+void HomieTopicAliases::Rebalance(std::vector<HomieProperty *> &vecCandidate)
+{
+	rebalanceTimestamp = millis();
+
+	uint16_t slots = GetSlots(maximum, estimateMaximum);
+	size_t top = std::min((size_t)slots, vecCandidate.size());
+	std::partial_sort(vecCandidate.begin(), vecCandidate.begin() + top, vecCandidate.end(), [](HomieProperty *a, HomieProperty *b) {
+		return a->topicAliasScore > b->topicAliasScore;
+	});
+
+	//properties that stay in the top keep their alias, so it doesn't have to be announced again
+	uint64_t used = 0; //bit alias-1
+	for (size_t i = 0; i < vecCandidate.size(); i++)
+	{
+		HomieProperty *pProp = vecCandidate[i];
+		if (i >= top || !pProp->topicAliasScore || pProp->topicAlias > slots)
+		{
+			pProp->topicAlias = 0;
+		}
+		else if (pProp->topicAlias)
+		{
+			used |= 1ull << (pProp->topicAlias - 1);
+		}
+	}
+
+	assigned = 0;
+	uint16_t next = 1;
+	for (size_t i = 0; i < top; i++)
+	{
+		HomieProperty *pProp = vecCandidate[i];
+		if (!pProp->topicAliasScore)
+			break;
+
+		if (!pProp->topicAlias)
+		{
+			while (used & (1ull << (next - 1)))
+				next++;
+			used |= 1ull << (next - 1);
+			pProp->topicAlias = next;
+			pProp->topicAliasSession = 0; //a reused number is mapped to its new topic on first use
+		}
+		assigned++;
+	}
+
+	//recent publishes count most
+	for (size_t i = 0; i < vecCandidate.size(); i++)
+	{
+		vecCandidate[i]->topicAliasScore >>= 1;
+	}
+}
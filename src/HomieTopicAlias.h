@@ -0,0 +1,46 @@
+#pragma once
+#include "Arduino.h"
+#include <vector>
+
+class HomieProperty;
+
+#define HOMIELIB_TOPIC_ALIAS_MAX 64 //slots used at most, whatever the broker grants
+
+//MQTT 5 topic aliases for the property topics published most often. Every rebalanceInterval_ms the properties
+//are ranked by their recent publish count and the top ones get the alias slots. The first publish of an alias in
+//a session carries topic and alias, later ones only the 3 byte alias property with an empty topic.
+//The broker grants the number of slots in CONNACK. MQTT 3.1.1 brokers (and AsyncMqttClient, which only speaks
+//3.1.1) grant none, the table then still ranks with estimateMaximum slots so GetBytesSavable reports what
+//aliases would save, while everything goes out with its full topic. Until there is an MQTT 5 client this is
+//only that estimate, so it's off by default and costs nothing per publish unless bEnabled is set.
+class HomieTopicAliases
+{
+public:
+	bool bEnabled = false;
+	uint16_t estimateMaximum = 16;
+	unsigned long rebalanceInterval_ms = 10000;
+
+	void OnConnected(uint16_t aliasMaximum); //the broker's Topic Alias Maximum, 0 for MQTT 3.1.1
+	bool IsActive() { return maximum > 0; }
+
+	//Called for every value publish, returns the alias to send (0 for none) and whether the topic goes with it
+	uint16_t OnPublish(HomieProperty *pProp, size_t topicLength, bool &bSendTopic);
+
+	bool IsRebalanceDue();
+	void Rebalance(std::vector<HomieProperty *> &vecCandidate); //reorders the vector
+
+	unsigned long GetTopicBytes() { return bytesTopic; } //topic bytes of all value publishes
+	unsigned long GetBytesSaved() { return bytesSaved; }
+	unsigned long GetBytesSavable() { return bytesSavable; } //what the 3.1.1 fallback would have saved with estimateMaximum
+	uint16_t GetAliasCount() { return assigned; }
+
+private:
+	uint16_t maximum = 0;
+	uint16_t assigned = 0;
+	uint16_t session = 0; //aliases are per connection, properties remember the session they last announced theirs in
+	unsigned long rebalanceTimestamp = 0;
+
+	unsigned long bytesTopic = 0;
+	unsigned long bytesSaved = 0;
+	unsigned long bytesSavable = 0;
+};
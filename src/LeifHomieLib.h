@@ -1,3 +1,14 @@
 #pragma once
 #include "HomieDevice.h"
-#include "HomieNode.h"
\ No newline at end of file
+#include "HomieNode.h"
+#include "HomieNumeric.h"
+#include "HomieColor.h"
+#include "HomieMetrics.h"
+#include "HomieLog.h"
+#include "HomieIndex.h"
+#include "HomieArena.h"
+#include "HomieHealth.h"
+#include "HomieTopicAlias.h"
+#include "HomieAlloc.h"
+#include "HomieSchema.h"
+#include "HomieDiscovery.h"
\ No newline at end of file